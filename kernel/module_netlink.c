@@ -1,97 +1,351 @@
 #include <net/netlink.h>
 #include <net/genetlink.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kernel.h>
-#include <linux/interrupt.h>
-#include <linux/timer.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
 #include <linux/time.h>
-#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <net/sock.h>
 #include <linux/skbuff.h>
 
 #include "nl_ts_module.h"
 
-#define TIMER_PERIOD 1*HZ
-#define TX_TS_PERIOD 5
-#define RX_TS_PERIOD 5
-static int mytimer_events = 0;
-static u64 tx_seq = 0;
-static u64 rx_seq = 0;
-static void mytimer_handler(unsigned long data);
-DEFINE_TIMER(mytimer, mytimer_handler, 0, 0);
-struct timespec ts_current;
+/* Load generator for the TS module. Registers n_ifaces interfaces
+ * (iface0, iface1, ...) and feeds every one of them rate tx and rate rx
+ * timestamps per second, burst at a time, from one kthread per CPU of
+ * cpus. The interfaces are shared round robin among the threads, or
+ * with shared every thread feeds every interface its share of rate,
+ * so that each queue is contended from all the CPUs. The threads sleep
+ * on an hrtimer between bursts and catch up without sleeping when
+ * late. With bulk, every burst goes in with one call of the bulk
+ * API, as from a driver's completion handler. What was offered and what
+ * the queues took is readable in /sys/module/mod_netlink/parameters/stats.
+ */
 
-static int nl_ts_desc;
+#define GEN_MAX_IFACES 4096
+#define GEN_MAX_RATE 10000000UL
+#define GEN_MAX_LAG_NS NSEC_PER_SEC	/* gives up catching up beyond */
 
-static void myprintk_ts(struct timespec *ts)
+static unsigned int n_ifaces = 1;
+module_param(n_ifaces, uint, 0444);
+MODULE_PARM_DESC(n_ifaces, "Interfaces to register (1-4096)");
+
+static unsigned long rate = 1;
+module_param(rate, ulong, 0444);
+MODULE_PARM_DESC(rate, "Tx and rx timestamps per second per interface");
+
+static unsigned int burst = 1;
+module_param(burst, uint, 0444);
+MODULE_PARM_DESC(burst, "Timestamps added back to back per wakeup");
+
+static bool bulk;
+module_param(bulk, bool, 0444);
+MODULE_PARM_DESC(bulk, "Add every burst with the bulk API");
+
+static unsigned int capacity = NL_TS_QUEUE_SIZE;
+module_param(capacity, uint, 0444);
+MODULE_PARM_DESC(capacity, "Capacity of every queue (1-65536)");
+
+static bool shared;
+module_param(shared, bool, 0444);
+MODULE_PARM_DESC(shared, "Feed every interface from every thread");
+
+static char *cpus = "0";
+module_param(cpus, charp, 0444);
+MODULE_PARM_DESC(cpus, "CPUs running a producer thread, as a cpu list");
+
+struct gen_iface {
+	char name[IFNAME_SIZE];
+	int desc;
+	atomic64_t tx_seq;	/* taken by all the threads, with shared */
+	atomic64_t rx_seq;
+};
+
+struct gen_producer {
+	struct task_struct *task;
+	int cpu;
+	int first;	/* of the interfaces, then every step-th */
+	int step;	/* n_producers, 1 with shared */
+	u64 offered;
+	u64 accepted;
+	u64 overwrote;	/* accepted by evicting an older timestamp */
+	u64 rejected;
+	struct nl_ts *batch;	/* burst timestamps, with bulk */
+};
+
+static struct gen_iface *gen_ifaces;
+static struct gen_producer *gen_producers;
+static int n_producers;
+
+static void gen_fill(struct gen_iface *gi, int type, struct nl_ts *ts)
+{
+	struct timespec64 now;
+
+	ktime_get_real_ts64(&now);
+
+	ts->sec = now.tv_sec;
+	ts->nsec = now.tv_nsec;
+	ts->valid = 1;
+	ts->ahead = 0;
+	ts->type = type;
+	if (type == MYNL_CMD_TX_OK_RESP)
+		ts->seq = atomic64_inc_return(&gi->tx_seq) - 1;
+	else
+		ts->seq = atomic64_inc_return(&gi->rx_seq) - 1;
+	ts->id = (u16) ts->seq;
+}
+
+static void gen_add(struct gen_producer *p, struct gen_iface *gi, int type)
 {
-	printk("%.2lu:%.2lu:%.2lu:%.6lu \n",
-		(ts->tv_sec / 3600) % (24),
-		(ts->tv_sec / 60) % (60),
-		ts->tv_sec % 60,
-		ts->tv_nsec / 1000);
+	struct nl_ts ts;
+	int rc;
+
+	gen_fill(gi, type, &ts);
+	if (type == MYNL_CMD_TX_OK_RESP)
+		rc = nl_ts_iface_tx_ts_add(gi->desc, &ts);
+	else
+		rc = nl_ts_iface_rx_ts_add(gi->desc, &ts);
+
+	p->offered++;
+	if (rc >= 0)
+		p->accepted++;
+	else
+		p->rejected++;
+	if (rc == NL_TS_QUEUE_OVERWROTE)
+		p->overwrote++;
 }
 
-static void mytimer_handler(unsigned long data)
+/* The bulk API does not tell about evictions, overwrote stays 0 */
+static void gen_add_bulk(struct gen_producer *p, struct gen_iface *gi,
+	int type)
 {
-		struct nl_ts tmp;
-		struct timespec *ts = &ts_current;
-		
-		getnstimeofday(ts);
-		
-		tmp.sec = ts->tv_sec;
-		tmp.nsec = ts->tv_nsec;
-		tmp.valid = 1;
-		tmp.ahead = 0;
-		tmp.id = 0;
-
-		if (mytimer_events % TX_TS_PERIOD == 0) {
-			tmp.type = MYNL_CMD_TX_OK_RESP;
-			tmp.seq = tx_seq;
-			nl_ts_iface_tx_ts_add(nl_ts_desc,&tmp);
-			tx_seq++;
+	unsigned int b;
+	int rc;
+
+	for (b = 0; b < burst; b++)
+		gen_fill(gi, type, &p->batch[b]);
+
+	if (type == MYNL_CMD_TX_OK_RESP)
+		rc = nl_ts_iface_tx_ts_add_bulk(gi->desc, p->batch, burst);
+	else
+		rc = nl_ts_iface_rx_ts_add_bulk(gi->desc, p->batch, burst);
+
+	p->offered += burst;
+	if (rc < 0)
+		rc = 0;
+	p->accepted += rc;
+	p->rejected += burst - rc;
+}
+
+static int gen_thread(void *data)
+{
+	struct gen_producer *p = data;
+	/* With shared, the threads split rate between them */
+	u64 period = div64_u64((u64) burst * NSEC_PER_SEC *
+		(shared ? n_producers : 1), rate);
+	ktime_t next = ktime_get();
+	unsigned int b;
+	int i;
+
+	while (!kthread_should_stop()) {
+		for (i = p->first; i < n_ifaces; i += p->step) {
+			if (bulk) {
+				gen_add_bulk(p, &gen_ifaces[i], MYNL_CMD_TX_OK_RESP);
+				gen_add_bulk(p, &gen_ifaces[i], MYNL_CMD_RX_OK_RESP);
+				continue;
+			}
+			for (b = 0; b < burst; b++) {
+				gen_add(p, &gen_ifaces[i], MYNL_CMD_TX_OK_RESP);
+				gen_add(p, &gen_ifaces[i], MYNL_CMD_RX_OK_RESP);
+			}
 		}
-			
-		if (mytimer_events % RX_TS_PERIOD == 0) {
-			tmp.type = MYNL_CMD_RX_OK_RESP;
-			tmp.seq = rx_seq;
-			nl_ts_iface_rx_ts_add(nl_ts_desc,&tmp);
-			rx_seq++;
+
+		next = ktime_add_ns(next, period);
+		if (ktime_to_ns(ktime_sub(ktime_get(), next)) > GEN_MAX_LAG_NS)
+			next = ktime_get();
+
+		if (ktime_after(next, ktime_get())) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!kthread_should_stop())
+				schedule_hrtimeout_range(&next,
+					min_t(u64, period / 16, NSEC_PER_MSEC),
+					HRTIMER_MODE_ABS);
+			__set_current_state(TASK_RUNNING);
+		} else {
+			cond_resched();
 		}
-		
-		mytimer_events++;
+	}
+
+	return 0;
+}
+
+static int gen_stats_show(char *buffer, size_t size)
+{
+	u64 offered = 0, accepted = 0, overwrote = 0, rejected = 0;
+	int i;
+
+	for (i = 0; i < n_producers; i++) {
+		offered += READ_ONCE(gen_producers[i].offered);
+		accepted += READ_ONCE(gen_producers[i].accepted);
+		overwrote += READ_ONCE(gen_producers[i].overwrote);
+		rejected += READ_ONCE(gen_producers[i].rejected);
+	}
+
+	return scnprintf(buffer, size,
+		"offered %llu accepted %llu overwrote %llu rejected %llu\n",
+		offered, accepted, overwrote, rejected);
+}
 
-		mod_timer(&mytimer, jiffies + TIMER_PERIOD);
+static int gen_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	return gen_stats_show(buffer, PAGE_SIZE);
+}
+
+static const struct kernel_param_ops gen_stats_ops = {
+	.get = gen_stats_get,
+};
+module_param_cb(stats, &gen_stats_ops, NULL, 0444);
+MODULE_PARM_DESC(stats, "Timestamps offered and taken by the queues");
+
+static void gen_stop(void)
+{
+	int i;
+
+	for (i = 0; i < n_producers; i++) {
+		if (gen_producers[i].task)
+			kthread_stop(gen_producers[i].task);
+	}
+}
+
+static void gen_free(void)
+{
+	int i;
+
+	for (i = 0; gen_producers && i < n_producers; i++)
+		kfree(gen_producers[i].batch);
+	kfree(gen_producers);
+	kfree(gen_ifaces);
+	gen_producers = NULL;
+	gen_ifaces = NULL;
+	n_producers = 0;
+}
+
+static void gen_unregister(int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		nl_ts_iface_unregister(gen_ifaces[i].desc);
 }
 
 static int __init module_netlink_init(void) {
-	
-	const char *ifname = "iface0";
-	
-	getnstimeofday(&ts_current);
-	myprintk_ts(&ts_current);
-	
-	nl_ts_desc = nl_ts_iface_register(ifname);
-	if(nl_ts_desc < 0)
-		goto failure;
-		
-	printk("Netlink TS iface: %s desc: %d \n", 
-		ifname, nl_ts_desc);
-	
-	mod_timer(&mytimer, jiffies+TIMER_PERIOD);
-
-	return 0; 
-failure:
-	return -1;
+
+	cpumask_var_t mask;
+	int rc = -EINVAL;
+	int cpu;
+	int i;
+
+	if (n_ifaces < 1 || n_ifaces > GEN_MAX_IFACES ||
+		rate < 1 || rate > GEN_MAX_RATE || burst < 1 || 
+		capacity < 1 || capacity > NL_TS_QUEUE_MAX_SIZE) {
+		printk("Netlink TS gen: bad n_ifaces, rate, burst or capacity \n");
+		return -EINVAL;
+	}
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	if (cpulist_parse(cpus, mask) != 0)
+		goto out_mask;
+	cpumask_and(mask, mask, cpu_online_mask);
+	n_producers = cpumask_weight(mask);
+	if (n_producers == 0) {
+		printk("Netlink TS gen: no online CPU in %s \n", cpus);
+		goto out_mask;
+	}
+	if (!shared && n_producers > n_ifaces)
+		n_producers = n_ifaces;
+
+	rc = -ENOMEM;
+	gen_ifaces = kcalloc(n_ifaces, sizeof(*gen_ifaces), GFP_KERNEL);
+	gen_producers = kcalloc(n_producers, sizeof(*gen_producers),
+		GFP_KERNEL);
+	if (!gen_ifaces || !gen_producers)
+		goto out_free;
+
+	for (i = 0; bulk && i < n_producers; i++) {
+		gen_producers[i].batch = kcalloc(burst,
+			sizeof(*gen_producers[i].batch), GFP_KERNEL);
+		if (!gen_producers[i].batch)
+			goto out_free;
+	}
+
+	for (i = 0; i < n_ifaces; i++) {
+		snprintf(gen_ifaces[i].name, IFNAME_SIZE, "iface%d", i);
+		rc = nl_ts_iface_register_capacity(gen_ifaces[i].name, capacity, 
+			NL_TS_POLICY_DROP_NEWEST);
+		if (rc < 0) {
+			gen_unregister(i);
+			goto out_free;
+		}
+		gen_ifaces[i].desc = rc;
+	}
+
+	i = 0;
+	for_each_cpu(cpu, mask) {
+		struct gen_producer *p = &gen_producers[i];
+
+		if (i >= n_producers)
+			break;
+
+		p->cpu = cpu;
+		p->first = shared ? 0 : i;
+		p->step = shared ? 1 : n_producers;
+		p->task = kthread_create(gen_thread, p, "nl_ts_gen/%d", cpu);
+		if (IS_ERR(p->task)) {
+			rc = PTR_ERR(p->task);
+			p->task = NULL;
+			gen_stop();
+			gen_unregister(n_ifaces);
+			goto out_free;
+		}
+		kthread_bind(p->task, cpu);
+		i++;
+	}
+
+	for (i = 0; i < n_producers; i++)
+		wake_up_process(gen_producers[i].task);
+
+	printk("Netlink TS gen: %u ifaces, %lu ts/s each way, burst %u%s, "
+		"%d%s threads on %s \n", n_ifaces, rate, burst,
+		bulk ? " (bulk)" : "", n_producers, shared ? " shared" : "",
+		cpus);
+
+	free_cpumask_var(mask);
+	return 0;
+
+out_free:
+	gen_free();
+out_mask:
+	free_cpumask_var(mask);
+	return rc;
 }
 
 static void __exit module_netlink_exit(void) {
-	
-	getnstimeofday(&ts_current);
-	myprintk_ts(&ts_current);
-	del_timer(&mytimer);
-	
-	nl_ts_iface_unregister(nl_ts_desc);
+
+	char buf[128];
+
+	gen_stop();
+	gen_stats_show(buf, sizeof(buf));
+	printk("Netlink TS gen: %s", buf);
+
+	gen_unregister(n_ifaces);
+	gen_free();
 }
 
 module_init(module_netlink_init);
@@ -0,0 +1,174 @@
+#ifndef __NL_TS_CODEC__
+#define __NL_TS_CODEC__
+
+#include <linux/types.h>
+
+#include "nl_ts_queue.h"
+
+/* NL_TS_ENC_DELTA stream, carried by NL_TS_A_TS_DELTA. Records come in
+ * runs sharing type, id, ahead and valid:
+ *
+ *   run:    u16 count (little endian), varint zz(type), varint id,
+ *           varint zz(ahead), varint zz(valid), then count records
+ *   record: varint zz(sec - sec'), varint zz(nsec - nsec'),
+ *           varint zz(seq - seq' - 1)
+ *
+ * where x' is the field of the previous record of the stream (0 before
+ * the first one), varints are LEB128 and zz() is zigzag. A timestamp
+ * one seq and a few microseconds after the previous one costs 4 bytes.
+ * Both ends keep a struct nl_ts_delta, zeroed before the first record.
+ */
+
+/* Largest encoding of one record, including a run header */
+#define NL_TS_DELTA_MAX_RECORD (2 + 4 * 10 + 3 * 10)
+
+struct nl_ts_delta {
+	__u64 sec;
+	__u64 nsec;
+	__u64 seq;
+	int type;
+	__u16 id;
+	int ahead;
+	int valid;
+	__u8 *run;		/* encoder: header of the current run */
+	unsigned int left;	/* decoder: records left in the run */
+};
+
+static inline __u64 nl_ts_zz_enc(__s64 v)
+{
+	return ((__u64) v << 1) ^ (__u64) (v >> 63);
+}
+
+static inline __s64 nl_ts_zz_dec(__u64 v)
+{
+	return (__s64) (v >> 1) ^ -(__s64) (v & 1);
+}
+
+static inline int nl_ts_varint_put(__u8 *p, __u64 v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (__u8) v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (__u8) v;
+
+	return n;
+}
+
+/* Returns the bytes used, 0 for a truncated or overlong varint */
+static inline int nl_ts_varint_get(const __u8 *p, const __u8 *end,
+	__u64 *v)
+{
+	int shift = 0;
+	int n = 0;
+
+	*v = 0;
+	while (p + n < end && shift < 64) {
+		*v |= (__u64) (p[n] & 0x7f) << shift;
+		if (!(p[n++] & 0x80))
+			return n;
+		shift += 7;
+	}
+
+	return 0;
+}
+
+/* Encode ts at out, which must have NL_TS_DELTA_MAX_RECORD bytes of
+ * room and directly follow what was encoded before. Returns the
+ * number of bytes written.
+ */
+static inline int nl_ts_delta_encode(struct nl_ts_delta *d,
+	const struct nl_ts *ts, __u8 *out)
+{
+	unsigned int count;
+	int n = 0;
+
+	count = d->run ? d->run[0] | d->run[1] << 8 : 0;
+
+	if (!d->run || count == 0xffff || ts->type != d->type ||
+		ts->id != d->id || ts->ahead != d->ahead ||
+		ts->valid != d->valid) {
+		d->run = out;
+		count = 0;
+		n += 2;
+		n += nl_ts_varint_put(out + n, nl_ts_zz_enc(ts->type));
+		n += nl_ts_varint_put(out + n, ts->id);
+		n += nl_ts_varint_put(out + n, nl_ts_zz_enc(ts->ahead));
+		n += nl_ts_varint_put(out + n, nl_ts_zz_enc(ts->valid));
+		d->type = ts->type;
+		d->id = ts->id;
+		d->ahead = ts->ahead;
+		d->valid = ts->valid;
+	}
+
+	count++;
+	d->run[0] = count & 0xff;
+	d->run[1] = count >> 8;
+
+	n += nl_ts_varint_put(out + n, nl_ts_zz_enc(ts->sec - d->sec));
+	n += nl_ts_varint_put(out + n, nl_ts_zz_enc(ts->nsec - d->nsec));
+	n += nl_ts_varint_put(out + n, nl_ts_zz_enc(ts->seq - d->seq - 1));
+	d->sec = ts->sec;
+	d->nsec = ts->nsec;
+	d->seq = ts->seq;
+
+	return n;
+}
+
+/* Decode the next record between p and end into ts. Returns the
+ * number of bytes used, or -1 for a malformed stream.
+ */
+static inline int nl_ts_delta_decode(struct nl_ts_delta *d,
+	const __u8 *p, const __u8 *end, struct nl_ts *ts)
+{
+	__u64 v[4];
+	int n = 0;
+	int i, k;
+
+	if (d->left == 0) {
+		if (end - p < 2)
+			return -1;
+		d->left = p[0] | p[1] << 8;
+		n = 2;
+
+		for (i = 0; i < 4; i++) {
+			k = nl_ts_varint_get(p + n, end, &v[i]);
+			if (k == 0)
+				return -1;
+			n += k;
+		}
+
+		if (d->left == 0)
+			return -1;
+		d->type = (int) nl_ts_zz_dec(v[0]);
+		d->id = (__u16) v[1];
+		d->ahead = (int) nl_ts_zz_dec(v[2]);
+		d->valid = (int) nl_ts_zz_dec(v[3]);
+	}
+
+	for (i = 0; i < 3; i++) {
+		k = nl_ts_varint_get(p + n, end, &v[i]);
+		if (k == 0)
+			return -1;
+		n += k;
+	}
+
+	d->sec += nl_ts_zz_dec(v[0]);
+	d->nsec += nl_ts_zz_dec(v[1]);
+	d->seq += nl_ts_zz_dec(v[2]) + 1;
+	d->left--;
+
+	ts->sec = d->sec;
+	ts->nsec = d->nsec;
+	ts->seq = d->seq;
+	ts->type = d->type;
+	ts->id = d->id;
+	ts->ahead = d->ahead;
+	ts->valid = d->valid;
+
+	return n;
+}
+
+#endif /* __NL_TS_CODEC__ */
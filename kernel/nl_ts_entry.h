@@ -0,0 +1,73 @@
+#ifndef __NL_TS_ENTRY_H__
+#define __NL_TS_ENTRY_H__
+
+#include <linux/list.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+
+#include "nl_ts_queue.h"
+
+/* Per interface state of nl_ts_module.c. Kept apart so that qbench 
+ * lays its queues out exactly as the module does.
+ */
+
+/* Requests parked on one queue, answered by work: as soon as a 
+ * timestamp is added, or at their deadline. Producers read count 
+ * without lock, the rest is under lock, next being the deadline work 
+ * is armed for, if armed.
+ */
+struct nl_ts_waiters {
+	spinlock_t lock;
+	struct list_head list;
+	unsigned int count;
+	int armed;
+	unsigned long next;
+	struct nl_ts_queue *q;
+	struct delayed_work work;
+} ____cacheline_aligned_in_smp;
+
+/* Pending timestamps per queue, must be a power of two */
+#define NL_TS_COALESCE_BACKLOG (4 * NL_TS_MAX_COALESCE_FRAMES)
+
+/* Timestamps of one queue waiting for its multicast group and 
+ * subscribers, in a ring from first. Producers only add them, the push 
+ * tasklet builds and sends the events, once frames of them are pending 
+ * or by timer, usecs after the first one. With frames 1 it is 
+ * scheduled for every add. Under lock, but for first which only the 
+ * push tasklet writes.
+ */
+struct nl_ts_coalesce {
+	spinlock_t lock;
+	unsigned int frames;
+	unsigned int usecs;
+	unsigned int first;
+	unsigned int count;
+	u64 deadline;	/* ns, usecs after the first pending */
+	int type;
+	int group;
+	struct nl_ts_table_entry *entry;
+	struct tasklet_hrtimer timer;
+	struct tasklet_struct push;
+	struct nl_ts pending[NL_TS_COALESCE_BACKLOG];
+} ____cacheline_aligned_in_smp;
+
+/* An entry is immutable once published in the table, apart from its 
+ * queues. It is freed one RCU grace period after being unpublished. 
+ * The queues are cache line aligned, so tx and rx producers and 
+ * consumers never write to a line the others use.
+ */
+struct nl_ts_table_entry {
+	int desc;
+	char ifname[IFNAME_SIZE];
+	int ifindex;
+	struct hlist_node name_node;
+	struct hlist_node ifindex_node;
+	struct nl_ts_queue tx_queue;
+	struct nl_ts_queue rx_queue;
+	struct nl_ts_waiters tx_waiters;
+	struct nl_ts_waiters rx_waiters;
+	struct nl_ts_coalesce tx_coalesce;
+	struct nl_ts_coalesce rx_coalesce;
+};
+
+#endif /* __NL_TS_ENTRY_H__ */
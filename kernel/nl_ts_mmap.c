@@ -0,0 +1,118 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/err.h>
+
+#include "nl_ts_mmap.h"
+
+/* Each open file of the device is bound to at most one queue mapping,
+ * kept in file->private_data.
+ */
+
+static int nl_ts_mmap_open(struct inode *inode, struct file *file)
+{
+	file->private_data = NULL;
+	
+	return 0;
+}
+
+static int nl_ts_mmap_release(struct inode *inode, struct file *file)
+{
+	struct nl_ts_queue_map *map = file->private_data;
+	
+	if (map)
+		nl_ts_queue_map_detach(map);
+	
+	return 0;
+}
+
+static long nl_ts_mmap_ioctl(struct file *file, unsigned int cmd, 
+	unsigned long arg)
+{
+	struct nl_ts_attach attach;
+	struct nl_ts_queue_map *map;
+	
+	if (cmd != NL_TS_IOC_ATTACH)
+		return -ENOTTY;
+	
+	if (copy_from_user(&attach, (void __user *) arg, sizeof(attach)))
+		return -EFAULT;
+	
+	attach.iface[IFNAME_SIZE - 1] = '\0';
+	
+	if (attach.type != MYNL_CMD_GETTS_TX && 
+		attach.type != MYNL_CMD_GETTS_RX)
+		return -EINVAL;
+	
+	map = nl_ts_iface_map_attach(attach.iface, attach.type);
+	if (IS_ERR(map))
+		return PTR_ERR(map);
+	
+	if (cmpxchg(&file->private_data, NULL, map) != NULL) {
+		nl_ts_queue_map_detach(map);
+		return -EBUSY;
+	}
+	
+	return 0;
+}
+
+static int nl_ts_mmap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct nl_ts_queue_map *map = file->private_data;
+	
+	if (!map)
+		return -ENODEV;
+	
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > map->size)
+		return -EINVAL;
+	
+	return remap_vmalloc_range(vma, map->hdr, 0);
+}
+
+static unsigned int nl_ts_mmap_poll(struct file *file, poll_table *wait)
+{
+	struct nl_ts_queue_map *map = file->private_data;
+	unsigned int mask = 0;
+	
+	if (!map)
+		return POLLERR;
+	
+	poll_wait(file, &map->wait, wait);
+	
+	if (READ_ONCE(map->hdr->head) != READ_ONCE(map->hdr->tail))
+		mask |= POLLIN | POLLRDNORM;
+	if (READ_ONCE(map->dead))
+		mask |= POLLHUP;
+	
+	return mask;
+}
+
+static const struct file_operations nl_ts_mmap_fops = {
+	.owner = THIS_MODULE,
+	.open = nl_ts_mmap_open,
+	.release = nl_ts_mmap_release,
+	.unlocked_ioctl = nl_ts_mmap_ioctl,
+	.mmap = nl_ts_mmap_mmap,
+	.poll = nl_ts_mmap_poll,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice nl_ts_mmap_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = NL_TS_DEV_NAME,
+	.fops = &nl_ts_mmap_fops,
+};
+
+int nl_ts_mmap_init(void)
+{
+	return misc_register(&nl_ts_mmap_dev);
+}
+
+void nl_ts_mmap_exit(void)
+{
+	misc_deregister(&nl_ts_mmap_dev);
+}
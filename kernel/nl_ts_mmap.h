@@ -0,0 +1,15 @@
+#ifndef __NL_TS_MMAP_H__
+#define __NL_TS_MMAP_H__
+
+#include "nl_ts_queue.h"
+
+int nl_ts_mmap_init(void);
+void nl_ts_mmap_exit(void);
+
+/* Provided by nl_ts_module.c: attach a mapping to the TX or RX queue 
+ * of a registered interface.
+ */
+struct nl_ts_queue_map *nl_ts_iface_map_attach(const char *ifname, 
+	int type);
+
+#endif /* __NL_TS_MMAP_H__ */
@@ -8,21 +8,75 @@
 #include <linux/jiffies.h>
 #include <net/sock.h>
 #include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
 
 #include "nl_ts_queue.h"
+#include "nl_ts_codec.h"
+#include "nl_ts_mmap.h"
+#include "nl_ts_entry.h"
 
-#define N_NL_TS_SLOTS 256
+#define NL_TS_HASH_BITS 6
+#define NL_TS_EVENT_MAX_TS NL_TS_MAX_COALESCE_FRAMES	/* per NL_TS_C_TS_EVENT */
+#define NL_TS_MAX_WAITERS 64	/* parked requests per queue */
+#define NL_TS_BATCH_CHUNK 8	/* dequeued at once by a batch reply */
 
-struct nl_ts_table_entry {
-	struct nl_ts_queue rx_queue;
-	struct nl_ts_queue tx_queue;
-	int assigned;
-	char ifname[IFNAME_SIZE];
+/* A NL_TS_C_GETTS_BATCH request parked on an empty queue */
+struct nl_ts_waiter {
+	struct list_head node;
+	struct net *net;
+	u32 portid;
+	u32 seq;
+	int packed;
+	int desc;
+	struct nl_ts_cmd cmd;
+	unsigned long deadline;	/* jiffies */
+};
+
+/* A NL_TS_C_SUBSCRIBE filter of the socket portid in net, on the 
+ * interface of desc or on any with -1. It holds a reference on net.
+ */
+struct nl_ts_sub {
+	struct list_head node;
+	struct rcu_head rcu;
+	struct net *net;
+	u32 portid;
+	int desc;
+	u32 types;	/* 1 << MYNL_CMD_*_OK_RESP */
+	u16 id_min;
+	u16 id_max;
+	int valid_only;
+};
+
+#define NL_TS_SUBS_ALL -2	/* every desc, for nl_ts_subs_remove() */
+
+/* Read under RCU by producers, updated under lock from process 
+ * context. count is read without lock to skip the list when empty.
+ */
+struct nl_ts_subs {
+	struct list_head list;
+	unsigned int count;
 	spinlock_t lock;
 };
 
+static struct nl_ts_subs nl_ts_subs;
+
+/* Entries by descriptor, and indexes (by name, and by ifindex when the 
+ * name is a net device at registration time) are read under RCU by 
+ * producers and consumers. Only register/unregister take lock, to 
+ * update them. descs grows with the registered interfaces, it only 
+ * allocates when one is added.
+ */
 struct nl_ts_table {
-	struct nl_ts_table_entry _nl_ts_table[N_NL_TS_SLOTS];
+	struct idr descs;
+	DECLARE_HASHTABLE(name_hash, NL_TS_HASH_BITS);
+	DECLARE_HASHTABLE(ifindex_hash, NL_TS_HASH_BITS);
+	struct mutex lock;
 };
 
 static struct nl_ts_table nl_ts_tbl;
@@ -32,11 +86,45 @@ static struct nl_ts_table nl_ts_tbl;
  */
 static struct nla_policy nl_ts_genl_policy[NL_TS_A_MAX + 1] = {
 	[NL_TS_A_TS_NESTED] = { .type = NLA_NESTED },
+	[NL_TS_A_MORE] = { .type = NLA_U32 },
+	[NL_TS_A_IFACE] = { .type = NLA_NUL_STRING, .len = IFNAME_SIZE-1 },
+	[NL_TS_A_DESC] = { .type = NLA_U32 },
+	[NL_TS_A_IFINDEX] = { .type = NLA_U32 },
+	[NL_TS_A_DROPPED] = { .type = NLA_U64 },
+	[NL_TS_A_STATS] = { .type = NLA_NESTED },
+	[NL_TS_A_HIST] = { .type = NLA_NESTED },
+	[NL_TS_A_TS_PACKED] = { .type = NLA_BINARY },
+	[NL_TS_A_TS_DELTA] = { .type = NLA_BINARY },
 };
 
 static struct nla_policy nl_ts_genl_cmd_nested_policy[NL_TS_A_CMD_NESTED_MAX + 1] = {
 	[NL_TS_A_CMD_NESTED_CMD] = { .type = NLA_U32 },
 	[NL_TS_A_CMD_NESTED_IFACE] = { .type = NLA_NUL_STRING, .len = IFNAME_SIZE-1 },
+	[NL_TS_A_CMD_NESTED_MAX_COUNT] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_DESC] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_IFINDEX] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_CAPACITY] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_POLICY] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_ID] = { .type = NLA_U16 },
+	[NL_TS_A_CMD_NESTED_SEQ] = { .type = NLA_U64 },
+	[NL_TS_A_CMD_NESTED_ENCODING] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_TIMEOUT] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_FRAMES] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_USECS] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_TYPES] = { .type = NLA_U32 },
+	[NL_TS_A_CMD_NESTED_ID_MIN] = { .type = NLA_U16 },
+	[NL_TS_A_CMD_NESTED_ID_MAX] = { .type = NLA_U16 },
+	[NL_TS_A_CMD_NESTED_VALID] = { .type = NLA_U32 },
+};
+
+enum {
+	NL_TS_MCGRP_TX,
+	NL_TS_MCGRP_RX,
+};
+
+static const struct genl_multicast_group nl_ts_mcgrps[] = {
+	[NL_TS_MCGRP_TX] = { .name = NL_TS_MCGRP_TX_NAME, },
+	[NL_TS_MCGRP_RX] = { .name = NL_TS_MCGRP_RX_NAME, },
 };
 
 //family definition
@@ -48,31 +136,80 @@ static struct genl_family nl_ts_gnl_family = {
 	.maxattr = NL_TS_A_MAX,
 };
 
+/* Callers hold rcu_read_lock() */
 static struct nl_ts_table_entry * nl_ts_table_entry_get(int desc)
 {
-	if (desc < 0 || desc > N_NL_TS_SLOTS)
+	if (desc < 0)
 		return NULL;
 	else
-		return  &(nl_ts_tbl._nl_ts_table[desc]);
+		return idr_find(&nl_ts_tbl.descs, desc);
+}
+
+static u32 nl_ts_name_hash(const char *ifname)
+{
+	return jhash(ifname, strnlen(ifname, IFNAME_SIZE), 0);
 }
 
-static int nl_ts_table_entry_get_by_ifname(char *ifname)
+static int nl_ts_table_entry_get_by_ifname(const char *ifname)
+{
+	int desc = -1;
+	struct nl_ts_table_entry *tmp = NULL;
+	
+	rcu_read_lock();
+	hash_for_each_possible_rcu(nl_ts_tbl.name_hash, tmp, name_node, 
+		nl_ts_name_hash(ifname)) {
+		if(!strncmp(tmp->ifname, ifname, IFNAME_SIZE)) {
+			desc = tmp->desc;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	
+	return desc;
+}
+
+static int nl_ts_table_entry_get_by_ifindex(int ifindex)
 {
 	int desc = -1;
 	struct nl_ts_table_entry *tmp = NULL;
-	int i;
 	
-	for(i = 0 ; i < N_NL_TS_SLOTS ; i++) {
-		tmp = &(nl_ts_tbl._nl_ts_table[i]);
-		if(!strcmp(tmp->ifname, ifname)) {
-			desc = i;
+	rcu_read_lock();
+	hash_for_each_possible_rcu(nl_ts_tbl.ifindex_hash, tmp, ifindex_node, 
+		ifindex) {
+		if(tmp->ifindex == ifindex) {
+			desc = tmp->desc;
 			break;
 		}
 	}
+	rcu_read_unlock();
 	
 	return desc;
 }
 
+/* The interface of a request is named, in order of preference, by 
+ * descriptor, by ifindex or by name.
+ */
+static int nl_ts_parse_iface(struct nlattr **nested, struct nl_ts_cmd *cmd)
+{
+	struct nlattr *na;
+	
+	na = nested[NL_TS_A_CMD_NESTED_DESC];
+	if (na)
+		return (int) nla_get_u32(na);
+	
+	na = nested[NL_TS_A_CMD_NESTED_IFINDEX];
+	if (na)
+		return nl_ts_table_entry_get_by_ifindex(nla_get_u32(na));
+	
+	na = nested[NL_TS_A_CMD_NESTED_IFACE];
+	if (na) {
+		nla_strlcpy(cmd->iface,na,IFNAME_SIZE);
+		return nl_ts_table_entry_get_by_ifname(cmd->iface);
+	}
+	
+	return -1;
+}
+
 static int nl_ts_parse_skb(struct sk_buff *skb, 
 	struct genl_info *info, struct nl_ts_cmd *cmd)
 {
@@ -82,7 +219,7 @@ static int nl_ts_parse_skb(struct sk_buff *skb,
 	struct nlattr *na;
 	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
 	
-	if (info == NULL) {
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL) {
 		cmd->cmd = MYNL_CMD_QERROR_RESP;
 	} else {
 		na = info->attrs[NL_TS_A_TS_NESTED];
@@ -90,8 +227,7 @@ static int nl_ts_parse_skb(struct sk_buff *skb,
 			NL_TS_A_CMD_NESTED_MAX, na, 
 			nl_ts_genl_cmd_nested_policy);
 	
-		if(!nested[NL_TS_A_CMD_NESTED_CMD] || 
-			!nested[NL_TS_A_CMD_NESTED_IFACE]) {
+		if(rc != 0 || !nested[NL_TS_A_CMD_NESTED_CMD]) {
 			cmd->cmd = MYNL_CMD_QERROR_RESP;
 		} else {
 			na = nested[NL_TS_A_CMD_NESTED_CMD];
@@ -99,12 +235,22 @@ static int nl_ts_parse_skb(struct sk_buff *skb,
 			
 			cmd->cmd = cmd_code;
 			
-			na = nested[NL_TS_A_CMD_NESTED_IFACE];
-			nla_strlcpy(cmd->iface,na,IFNAME_SIZE);
+			na = nested[NL_TS_A_CMD_NESTED_MAX_COUNT];
+			if (na)
+				cmd->max_count = nla_get_u32(na);
+			
+			na = nested[NL_TS_A_CMD_NESTED_ENCODING];
+			if (na)
+				cmd->encoding = nla_get_u32(na);
 			
-			iface_desc = nl_ts_table_entry_get_by_ifname(cmd->iface);
+			na = nested[NL_TS_A_CMD_NESTED_TIMEOUT];
+			if (na)
+				cmd->timeout = min_t(u32, nla_get_u32(na), 
+					NL_TS_MAX_TIMEOUT_MS);
 			
-			if (iface_desc < 0 || iface_desc >= N_NL_TS_SLOTS) {
+			iface_desc = nl_ts_parse_iface(nested, cmd);
+			
+			if (iface_desc < 0) {
 				cmd->cmd = MYNL_CMD_QERROR_RESP;
 			} 
 		}
@@ -113,27 +259,20 @@ static int nl_ts_parse_skb(struct sk_buff *skb,
 	return iface_desc;
 }
 
-static int nl_ts_userland_send(struct nl_ts *ts, 
-	struct genl_info *info)
+/* Room needed in the skb for one NL_TS_A_TS_NESTED record */
+static int nl_ts_ts_nested_size(void)
+{
+	return nla_total_size(0) +
+		3 * nla_total_size(sizeof(u64)) +
+		nla_total_size(sizeof(u16)) +
+		3 * nla_total_size(sizeof(u32));
+}
+
+static int nl_ts_ts_put(struct sk_buff *skb, struct nl_ts *ts)
 {
-	struct sk_buff *skb;
 	int rc = 0;
-	void *msg_head;
 	struct nlattr *na;
 	
-	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
-	if (skb == NULL) {
-		rc = -1;
-		goto out;
-	}
-	 
-	msg_head = genlmsg_put(skb, 0, info->snd_seq+1, 
-		&nl_ts_gnl_family, 0, NL_TS_C_GETTS);
-	if (msg_head == NULL) {
-		rc = -ENOMEM;
-		goto out;
-	}
-	
 	na = nla_nest_start(skb, 
 		NL_TS_A_TS_NESTED);
 	if(!na) {
@@ -198,6 +337,109 @@ static int nl_ts_userland_send(struct nl_ts *ts,
 	}
 	
 	nla_nest_end(skb, na);
+
+out:
+	return rc;
+}
+
+/* Whether the client of a request reads NL_TS_A_TS_PACKED */
+static int nl_ts_packed_ok(struct genl_info *info)
+{
+	return info->genlhdr->version >= NL_TS_VERSION_PACKED;
+}
+
+/* Append one record to the NL_TS_A_TS_PACKED array at the tail of skb */
+static int nl_ts_ts_append_packed(struct sk_buff *skb, struct nl_ts *ts)
+{
+	struct nl_ts_packed p;
+	
+	if (skb_tailroom(skb) < (int) sizeof(p))
+		return -EMSGSIZE;
+	
+	p.sec = ts->sec;
+	p.nsec = ts->nsec;
+	p.seq = ts->seq;
+	p.ahead = ts->ahead;
+	p.id = ts->id;
+	p.type = (u8) ts->type;
+	p.valid = (u8) ts->valid;
+	
+	/* The tail is only 4 byte aligned */
+	memcpy(skb_put(skb, sizeof(p)), &p, sizeof(p));
+	
+	return 0;
+}
+
+static int nl_ts_ts_append_delta(struct sk_buff *skb, 
+	struct nl_ts_delta *d, struct nl_ts *ts)
+{
+	/* Also keeps room for the padding added by nl_ts_array_end() */
+	if (skb_tailroom(skb) < NL_TS_DELTA_MAX_RECORD + NLA_ALIGNTO)
+		return -EMSGSIZE;
+	
+	skb_put(skb, nl_ts_delta_encode(d, ts, skb_tail_pointer(skb)));
+	
+	return 0;
+}
+
+/* Binary attribute whose payload is appended to the tail of skb until 
+ * nl_ts_array_end() sets its length.
+ */
+static struct nlattr *nl_ts_array_start(struct sk_buff *skb, int attrtype)
+{
+	return nla_reserve(skb, attrtype, 0);
+}
+
+static void nl_ts_array_end(struct sk_buff *skb, struct nlattr *na)
+{
+	int len = skb_tail_pointer(skb) - (unsigned char *) na;
+	
+	na->nla_len = len;
+	if (NLA_ALIGN(len) != len)
+		memset(skb_put(skb, NLA_ALIGN(len) - len), 0, 
+			NLA_ALIGN(len) - len);
+}
+
+/* One timestamp in the format the client asked for */
+static int nl_ts_ts_put_fmt(struct sk_buff *skb, struct nl_ts *ts, 
+	int packed)
+{
+	struct nlattr *na;
+	
+	if (!packed)
+		return nl_ts_ts_put(skb, ts);
+	
+	na = nl_ts_array_start(skb, NL_TS_A_TS_PACKED);
+	if (!na || nl_ts_ts_append_packed(skb, ts) != 0)
+		return -1;
+	
+	nl_ts_array_end(skb, na);
+	return 0;
+}
+
+static int nl_ts_userland_send(struct nl_ts *ts, 
+	struct genl_info *info)
+{
+	struct sk_buff *skb;
+	int rc = 0;
+	void *msg_head;
+	
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (skb == NULL) {
+		rc = -1;
+		goto out;
+	}
+	 
+	msg_head = genlmsg_put(skb, 0, info->snd_seq, 
+		&nl_ts_gnl_family, 0, NL_TS_C_GETTS);
+	if (msg_head == NULL) {
+		rc = -ENOMEM;
+		goto out_free;
+	}
+	
+	rc = nl_ts_ts_put_fmt(skb, ts, nl_ts_packed_ok(info));
+	if (rc != 0)
+		goto out_free;
 	
 	genlmsg_end(skb, msg_head);
 	
@@ -209,11 +451,14 @@ static int nl_ts_userland_send(struct nl_ts *ts,
 	
 	return rc;
 
+out_free:
+	nlmsg_free(skb);
 out:
 	return rc;
 }
 
 int nl_ts_getts(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
 	int rx_queue_cmd = 0;
 	int tx_queue_cmd = 0;
 	int queue_cmd = 0;
@@ -222,7 +467,6 @@ int nl_ts_getts(struct sk_buff *skb, struct genl_info *info) {
 	struct nl_ts_cmd cmd;
 	struct nl_ts_queue *tx_q = NULL;
 	struct nl_ts_queue *rx_q = NULL;
-	struct nl_ts_queue_element *qe = NULL;
 	struct nl_ts_table_entry * tbl_entry = NULL;
 	
 	ts.sec = 0;
@@ -245,37 +489,42 @@ int nl_ts_getts(struct sk_buff *skb, struct genl_info *info) {
 	tx_queue_cmd = (cmd.cmd == 0);
 	queue_cmd = rx_queue_cmd || tx_queue_cmd;
 	
+	/* The entry cannot be freed before rcu_read_unlock() */
+	rcu_read_lock();
 	tbl_entry = nl_ts_table_entry_get(iface_desc);
 	
-	if(!tbl_entry || !tbl_entry->assigned)
+	if(!tbl_entry)
 		queue_cmd = 0;
 	
 	if (queue_cmd) {
 		if(rx_queue_cmd) {
 			rx_q = &(tbl_entry->rx_queue);
 			
-			qe = nl_ts_queue_dequeue(rx_q);
-			if(qe) {
-				ts = qe->ts;
+			rc = nl_ts_queue_dequeue(rx_q, &ts);
+			if(rc == 0) {
 				ts.type = MYNL_CMD_RX_OK_RESP;
-			} else {
+			} else if(rc == -ENOENT) {
 				ts.type = MYNL_CMD_QEMPTY_RESP;
+				nl_ts_queue_count_empty_poll(rx_q);
+			} else {
+				ts.type = MYNL_CMD_QERROR_RESP;
 			}
 		}
 		else {
 			tx_q = &(tbl_entry->tx_queue);
 			
-			qe = nl_ts_queue_dequeue(tx_q);
-			if(qe) {
-				ts = qe->ts;
+			rc = nl_ts_queue_dequeue(tx_q, &ts);
+			if(rc == 0) {
 				ts.type = MYNL_CMD_TX_OK_RESP;
-			} else {
+			} else if(rc == -ENOENT) {
 				ts.type = MYNL_CMD_QEMPTY_RESP;
+				nl_ts_queue_count_empty_poll(tx_q);
+			} else {
+				ts.type = MYNL_CMD_QERROR_RESP;
 			}
 		}
-			
-		kfree(qe);
 	}
+	rcu_read_unlock();
 	
 out:
 	nl_ts_userland_send(&ts,info);
@@ -283,171 +532,1676 @@ out:
 	return 0;
 }
 
-struct genl_ops nl_ts_gnl_ops[NL_TS_C_MAX+1] = {
-		[NL_TS_C_GETTS] = {
-			.cmd = NL_TS_C_GETTS,
-			.flags = 0,
-			.policy = nl_ts_genl_policy,
-			.doit = nl_ts_getts,
-			.dumpit = NULL,
-		},
-};
-
-int nl_ts_iface_tx_ts_add(int iface_desc, struct nl_ts *ts)
-{
+/* Take the timestamp of one frame, by id and seq, out of a queue */
+int nl_ts_getts_id(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	int dq_rc = -ENODEV;
+	int iface_desc;
+	int rx_queue_cmd = 0;
+	struct nl_ts ts;
+	struct nl_ts_cmd cmd;
+	struct nl_ts_queue *q = NULL;
 	struct nl_ts_table_entry * tbl_entry = NULL;
-	struct nl_ts_queue_element * ts_q_elem = NULL;
-	struct nl_ts_queue * ts_q = NULL;
-	spinlock_t *sl  = NULL;
-	unsigned long flags;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	struct sk_buff *rskb;
+	void *msg_head;
 	
-	if(!ts)
-		return -1;
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL)
+		return -EINVAL;
+	
+	rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+		info->attrs[NL_TS_A_TS_NESTED], 
+		nl_ts_genl_cmd_nested_policy);
+	if (rc != 0)
+		return rc;
+	
+	if (!nested[NL_TS_A_CMD_NESTED_ID] || !nested[NL_TS_A_CMD_NESTED_SEQ])
+		return -EINVAL;
+	
+	if (nested[NL_TS_A_CMD_NESTED_CMD])
+		rx_queue_cmd = (nla_get_u32(nested[NL_TS_A_CMD_NESTED_CMD]) == 
+			MYNL_CMD_GETTS_RX);
+	
+	memset((void *) &ts, 0, sizeof(ts));
+	memset((void *) &cmd, 0, sizeof(cmd));
 	
+	iface_desc = nl_ts_parse_iface(nested, &cmd);
+	
+	/* Allocated first so that a taken timestamp is never lost */
+	rskb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (rskb == NULL)
+		return -ENOMEM;
+	
+	rcu_read_lock();
 	tbl_entry = nl_ts_table_entry_get(iface_desc);
-	if(!tbl_entry)
-		return -1;
-		
-	sl = &(tbl_entry->lock);
+	if (tbl_entry) {
+		q = rx_queue_cmd ? &(tbl_entry->rx_queue) : 
+			&(tbl_entry->tx_queue);
+		dq_rc = nl_ts_queue_take(q, 
+			nla_get_u16(nested[NL_TS_A_CMD_NESTED_ID]), 
+			nla_get_u64(nested[NL_TS_A_CMD_NESTED_SEQ]), &ts);
+		if (dq_rc == -ENOENT)
+			nl_ts_queue_count_empty_poll(q);
+	}
+	rcu_read_unlock();
 	
-	spin_lock_irqsave(sl, flags);
-	ts_q_elem = nl_ts_queue_kmalloc(ts);
-	ts_q = &(tbl_entry->tx_queue);
-	if(ts_q_elem)
-		nl_ts_queue_enqueue(ts_q,ts_q_elem);
+	if (dq_rc == 0)
+		ts.type = rx_queue_cmd ? MYNL_CMD_RX_OK_RESP : 
+			MYNL_CMD_TX_OK_RESP;
+	else if (dq_rc == -ENOENT)
+		ts.type = MYNL_CMD_QEMPTY_RESP;
+	else
+		ts.type = MYNL_CMD_QERROR_RESP;
+	
+	msg_head = genlmsg_put(rskb, 0, info->snd_seq, 
+		&nl_ts_gnl_family, 0, NL_TS_C_GETTS_ID);
+	if (msg_head == NULL) {
+		rc = -ENOMEM;
+		goto out_free;
+	}
+	
+	rc = nl_ts_ts_put_fmt(rskb, &ts, nl_ts_packed_ok(info));
+	if (rc != 0)
+		goto out_free;
+	
+	genlmsg_end(rskb, msg_head);
+	
+	return genlmsg_unicast(genl_info_net(info), rskb, info->snd_portid);
 
-	spin_unlock_irqrestore(sl, flags);
-		
-	return 0;
+out_free:
+	nlmsg_free(rskb);
+	return rc;
 }
-EXPORT_SYMBOL(nl_ts_iface_tx_ts_add);
 
-int nl_ts_iface_rx_ts_add(int iface_desc, struct nl_ts *ts)
+/* Drain up to cmd.max_count timestamps (0: as many as fit) from one 
+ * queue into a single reply. NL_TS_A_MORE tells the client whether 
+ * the queue still holds timestamps after the reply was filled, and 
+ * NL_TS_A_DROPPED how many it lost so far. Packed replies carry all 
+ * records in a single NL_TS_A_TS_PACKED array, NL_TS_ENC_DELTA ones in 
+ * a single NL_TS_A_TS_DELTA stream.
+ */
+static int nl_ts_batch_reply(struct net *net, u32 portid, u32 seq, 
+	int packed_ok, struct nl_ts_cmd *cmd, int iface_desc)
 {
+	int rc = 0;
+	int dq_rc = -ENODEV;
+	int rx_queue_cmd = 0;
+	int tx_queue_cmd = 0;
+	unsigned int count = 0;
+	unsigned int want;
+	unsigned int i;
+	u32 more = 0;
+	u64 dropped = 0;
+	struct nl_ts ts;
+	struct nl_ts chunk[NL_TS_BATCH_CHUNK];
+	struct nl_ts_queue *q = NULL;
 	struct nl_ts_table_entry * tbl_entry = NULL;
-	struct nl_ts_queue_element * ts_q_elem = NULL;
-	struct nl_ts_queue * ts_q = NULL;
-	spinlock_t *sl  = NULL;
-	unsigned long flags;
+	struct sk_buff *rskb;
+	struct nlattr *packed = NULL;
+	struct nlattr *delta = NULL;
+	struct nl_ts_delta d;
+	void *msg_head;
+	int room;
+	int trailer;
 	
-	if(!ts)
-		return -1;
-		
-	tbl_entry = nl_ts_table_entry_get(iface_desc);
-	if(!tbl_entry)
-		return -1;
-		
-	sl = &(tbl_entry->lock);
+	memset((void *) &ts, 0, sizeof(ts));
 	
-	spin_lock_irqsave(sl, flags);
-	ts_q_elem = nl_ts_queue_kmalloc(ts);
-	ts_q = &(tbl_entry->rx_queue);
-	if(ts_q_elem)
-		nl_ts_queue_enqueue(ts_q,ts_q_elem);
-		
-	spin_unlock_irqrestore(sl, flags);
-		
-	return 0;
-}
-EXPORT_SYMBOL(nl_ts_iface_rx_ts_add);
-
-int nl_ts_iface_register(const char *iface)
-{
-	unsigned long flags;
-	spinlock_t *sl  = NULL;
-	struct nl_ts_table_entry * tbl_entry  = NULL;
-	int i;
-	int desc = -1;
+	rx_queue_cmd = (cmd->cmd == MYNL_CMD_GETTS_RX);
+	tx_queue_cmd = (cmd->cmd == MYNL_CMD_GETTS_TX);
 	
-	for(i = 0 ; i < N_NL_TS_SLOTS ; i++) {
-		tbl_entry = nl_ts_table_entry_get(i);
-		sl = &(tbl_entry->lock);
-		spin_lock_irqsave(sl, flags);
-		if(tbl_entry->assigned == 0) {
-			desc = i;
-			strncpy(tbl_entry->ifname, iface, 10);
-			tbl_entry->assigned = 1;
-			nl_ts_queue_init(&tbl_entry->tx_queue);
-			nl_ts_queue_init(&tbl_entry->rx_queue);
-			spin_unlock_irqrestore(sl, flags);
-			break;
+	rskb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (rskb == NULL)
+		return -ENOMEM;
+	
+	msg_head = genlmsg_put(rskb, 0, seq, 
+		&nl_ts_gnl_family, 0, NL_TS_C_GETTS_BATCH);
+	if (msg_head == NULL) {
+		rc = -ENOMEM;
+		goto out_free;
+	}
+	
+	if (cmd->encoding == NL_TS_ENC_DELTA) {
+		memset(&d, 0, sizeof(d));
+		delta = nl_ts_array_start(rskb, NL_TS_A_TS_DELTA);
+		if (!delta) {
+			rc = -EMSGSIZE;
+			goto out_free;
 		}
-		spin_unlock_irqrestore(sl, flags);
+		room = NL_TS_DELTA_MAX_RECORD + NLA_ALIGNTO;
+	} else if (packed_ok) {
+		packed = nl_ts_array_start(rskb, NL_TS_A_TS_PACKED);
+		if (!packed) {
+			rc = -EMSGSIZE;
+			goto out_free;
+		}
+		room = sizeof(struct nl_ts_packed);
+	} else {
+		room = nl_ts_ts_nested_size();
 	}
 	
-	return desc;
-}
-EXPORT_SYMBOL(nl_ts_iface_register);
-
-int nl_ts_iface_unregister(int iface_desc)
-{
-	unsigned long flags;
-	spinlock_t *sl  = NULL;
-	struct nl_ts_table_entry * tbl_entry  = NULL;
+	/* Keep room for NL_TS_A_MORE and NL_TS_A_DROPPED at the end */
+	trailer = nla_total_size(sizeof(u32)) + nla_total_size(sizeof(u64));
 	
+	/* The reply is filled without sleeping, under RCU */
+	rcu_read_lock();
 	tbl_entry = nl_ts_table_entry_get(iface_desc);
-	if(!tbl_entry)
-		return -1;
+	if (tbl_entry) {
+		if (rx_queue_cmd)
+			q = &(tbl_entry->rx_queue);
+		else if (tx_queue_cmd)
+			q = &(tbl_entry->tx_queue);
+	}
+	
+	/* As many as surely fit per dequeue, which merges the stages */
+	while (q && (cmd->max_count == 0 || count < cmd->max_count) &&
+		skb_tailroom(rskb) >= room + trailer) {
+		want = min_t(unsigned int, NL_TS_BATCH_CHUNK, 
+			(skb_tailroom(rskb) - trailer) / room);
+		if (cmd->max_count)
+			want = min(want, cmd->max_count - count);
+		
+		dq_rc = nl_ts_queue_dequeue_bulk(q, chunk, want);
+		if (dq_rc <= 0) {
+			if (dq_rc == 0)
+				dq_rc = -ENOENT;
+			break;
+		}
+		
+		for (i = 0; i < dq_rc; i++) {
+			chunk[i].type = rx_queue_cmd ? MYNL_CMD_RX_OK_RESP : 
+				MYNL_CMD_TX_OK_RESP;
+			
+			if (delta)
+				rc = nl_ts_ts_append_delta(rskb, &d, &chunk[i]);
+			else if (packed)
+				rc = nl_ts_ts_append_packed(rskb, &chunk[i]);
+			else
+				rc = nl_ts_ts_put(rskb, &chunk[i]);
+			if (rc != 0)
+				goto out_unlock;
+			count++;
+		}
 		
-	sl = &(tbl_entry->lock);
+		if (dq_rc < want) {
+			dq_rc = -ENOENT;
+			break;
+		}
+	}
 	
-	spin_lock_irqsave(sl, flags);
-	if(tbl_entry->assigned == 1) {
-		tbl_entry->assigned = 0;
-		strncpy(tbl_entry->ifname,
-			"NULL",10);
-		nl_ts_queue_kfree(&tbl_entry->tx_queue);
-		nl_ts_queue_kfree(&tbl_entry->rx_queue);
+	if (count == 0) {
+		ts.type = (dq_rc == -ENOENT) ? MYNL_CMD_QEMPTY_RESP : 
+			MYNL_CMD_QERROR_RESP;
+		if (dq_rc == -ENOENT)
+			nl_ts_queue_count_empty_poll(q);
+		if (delta)
+			rc = nl_ts_ts_append_delta(rskb, &d, &ts);
+		else if (packed)
+			rc = nl_ts_ts_append_packed(rskb, &ts);
+		else
+			rc = nl_ts_ts_put(rskb, &ts);
+		if (rc != 0)
+			goto out_unlock;
 	}
-	spin_unlock_irqrestore(sl, flags);
 	
-	return 0;
-}
-EXPORT_SYMBOL(nl_ts_iface_unregister);
-
-static int __init nl_ts_module_init(void) {
-	int rc;
-	struct genl_ops * ops = &nl_ts_gnl_ops[NL_TS_C_GETTS];
-	struct nl_ts_table_entry * tbl_entry  = NULL;
-	int i;
+	if (delta)
+		nl_ts_array_end(rskb, delta);
+	else if (packed)
+		nl_ts_array_end(rskb, packed);
 	
-	for(i = 0 ; i < N_NL_TS_SLOTS ; i++) {
-		tbl_entry = &(nl_ts_tbl._nl_ts_table[i]);
-		tbl_entry->assigned = 0;
-		strncpy(tbl_entry->ifname,
-			"NULL",10);
-		spin_lock_init(&(tbl_entry->lock));
+	if (q) {
+		more = !nl_ts_queue_is_empty(q);
+		dropped = nl_ts_queue_dropped(q);
 	}
+	rcu_read_unlock();
 	
-	// Fill the family ops
-	nl_ts_gnl_family.ops = ops;
-	nl_ts_gnl_family.n_ops = NL_TS_C_MAX;
-	nl_ts_gnl_family.mcgrps = NULL;
-	nl_ts_gnl_family.n_mcgrps = 0;
+	rc = nla_put_u32(rskb, NL_TS_A_MORE, more);
+	if (rc != 0)
+		goto out_free;
 	
-	// Register the family
-	rc = genl_register_family(&nl_ts_gnl_family);
-	if (rc != 0) {
-		goto failure;
-	}
+	rc = nla_put_u64(rskb, NL_TS_A_DROPPED, dropped);
+	if (rc != 0)
+		goto out_free;
 	
-	printk("Installed the Netlink TS family. \n");
+	genlmsg_end(rskb, msg_head);
+	
+	return genlmsg_unicast(net, rskb, portid);
 
-	return 0; 
-failure:
-	printk("Error registering the Netlink TS family. \n");
-	return -1;
+out_unlock:
+	rcu_read_unlock();
+out_free:
+	nlmsg_free(rskb);
+	return rc;
 }
 
-static void __exit nl_ts_module_exit(void) {
-	int ret;
-	
-	//Unregister the family
-	ret = genl_unregister_family(&nl_ts_gnl_family);
+static struct nl_ts_waiters *nl_ts_waiters_get(
+	struct nl_ts_table_entry *tbl_entry, int type)
+{
+	if (type == MYNL_CMD_GETTS_RX || type == MYNL_CMD_RX_OK_RESP)
+		return &tbl_entry->rx_waiters;
+	else
+		return &tbl_entry->tx_waiters;
+}
+
+/* Called with lock held */
+static void nl_ts_waiters_arm(struct nl_ts_waiters *w, 
+	unsigned long deadline)
+{
+	unsigned long now = jiffies;
+	
+	if (w->armed && !time_before(deadline, w->next))
+		return;
+	
+	w->armed = 1;
+	w->next = deadline;
+	mod_delayed_work(system_wq, &w->work, 
+		time_after(deadline, now) ? deadline - now : 0);
+}
+
+/* After a timestamp was added to the queue of w */
+static void nl_ts_waiters_kick(struct nl_ts_waiters *w)
+{
+	/* Pairs with the barrier in nl_ts_park() */
+	smp_mb();
+	if (READ_ONCE(w->count))
+		mod_delayed_work(system_wq, &w->work, 0);
+}
+
+/* Parks a request on its queue if it is empty. Returns 0 once parked, 
+ * -EAGAIN when the request is to be answered right away.
+ */
+static int nl_ts_park(struct genl_info *info, struct nl_ts_cmd *cmd, 
+	int iface_desc)
+{
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nl_ts_waiters *w = NULL;
+	struct nl_ts_waiter *wt;
+	int rc = -EAGAIN;
+	
+	if (cmd->cmd != MYNL_CMD_GETTS_TX && cmd->cmd != MYNL_CMD_GETTS_RX)
+		return -EAGAIN;
+	
+	wt = kzalloc(sizeof(*wt), GFP_KERNEL);
+	if (!wt)
+		return -EAGAIN;
+	
+	wt->net = get_net(genl_info_net(info));
+	wt->portid = info->snd_portid;
+	wt->seq = info->snd_seq;
+	wt->packed = nl_ts_packed_ok(info);
+	wt->desc = iface_desc;
+	wt->cmd = *cmd;
+	wt->deadline = jiffies + msecs_to_jiffies(cmd->timeout);
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if (!tbl_entry)
+		goto out_unlock;
+	
+	/* A mapped queue answers with an error anyway */
+	w = nl_ts_waiters_get(tbl_entry, cmd->cmd);
+	if (!nl_ts_queue_is_empty(w->q) || atomic_read(&w->q->map->attached))
+		goto out_unlock;
+	
+	spin_lock(&w->lock);
+	if (w->count < NL_TS_MAX_WAITERS) {
+		list_add_tail(&wt->node, &w->list);
+		WRITE_ONCE(w->count, w->count + 1);
+		nl_ts_waiters_arm(w, wt->deadline);
+		rc = 0;
+	}
+	spin_unlock(&w->lock);
+	
+	/* Either the producer of a timestamp the check above missed sees 
+	 * count, or this sees the timestamp.
+	 */
+	if (rc == 0) {
+		smp_mb();
+		if (!nl_ts_queue_is_empty(w->q))
+			mod_delayed_work(system_wq, &w->work, 0);
+	}
+
+out_unlock:
+	rcu_read_unlock();
+	
+	if (rc != 0) {
+		put_net(wt->net);
+		kfree(wt);
+	}
+	return rc;
+}
+
+/* Answers parked requests, oldest first while the queue holds 
+ * timestamps, then the expired ones, and arms the work for the next 
+ * deadline. With all, answers every one of them with 
+ * MYNL_CMD_QERROR_RESP, for an interface going away.
+ */
+static void nl_ts_waiters_run(struct nl_ts_waiters *w, int all)
+{
+	struct nl_ts_waiter *wt, *tmp;
+	unsigned long now;
+	
+	for (;;) {
+		now = jiffies;
+		wt = NULL;
+		
+		spin_lock(&w->lock);
+		if (all || !nl_ts_queue_is_empty(w->q)) {
+			wt = list_first_entry_or_null(&w->list, 
+				struct nl_ts_waiter, node);
+		} else {
+			list_for_each_entry(tmp, &w->list, node) {
+				if (!time_before(now, tmp->deadline)) {
+					wt = tmp;
+					break;
+				}
+			}
+		}
+		
+		if (wt) {
+			list_del(&wt->node);
+			WRITE_ONCE(w->count, w->count - 1);
+		} else {
+			w->armed = 0;
+			list_for_each_entry(tmp, &w->list, node)
+				nl_ts_waiters_arm(w, tmp->deadline);
+		}
+		spin_unlock(&w->lock);
+		
+		if (!wt)
+			break;
+		
+		nl_ts_batch_reply(wt->net, wt->portid, wt->seq, wt->packed, 
+			&wt->cmd, all ? -1 : wt->desc);
+		put_net(wt->net);
+		kfree(wt);
+	}
+}
+
+static void nl_ts_waiters_work(struct work_struct *work)
+{
+	struct nl_ts_waiters *w = container_of(to_delayed_work(work), 
+		struct nl_ts_waiters, work);
+	
+	nl_ts_waiters_run(w, 0);
+}
+
+static void nl_ts_waiters_init(struct nl_ts_waiters *w, 
+	struct nl_ts_queue *q)
+{
+	spin_lock_init(&w->lock);
+	INIT_LIST_HEAD(&w->list);
+	w->q = q;
+	INIT_DELAYED_WORK(&w->work, nl_ts_waiters_work);
+}
+
+/* Once no producer nor request can reach the entry any more */
+static void nl_ts_waiters_stop(struct nl_ts_waiters *w)
+{
+	cancel_delayed_work_sync(&w->work);
+	nl_ts_waiters_run(w, 1);
+}
+
+int nl_ts_getts_batch(struct sk_buff *skb, struct genl_info *info) {
+	int iface_desc;
+	struct nl_ts_cmd cmd;
+	
+	if (info == NULL)
+		return 0;
+	
+	memset((void *) &cmd, 0, sizeof(cmd));
+
+	iface_desc = nl_ts_parse_skb(skb,info,&cmd);
+	
+	/* Answered later, by nl_ts_waiters_work() */
+	if (cmd.timeout && nl_ts_park(info, &cmd, iface_desc) == 0)
+		return 0;
+	
+	return nl_ts_batch_reply(genl_info_net(info), info->snd_portid, 
+		info->snd_seq, nl_ts_packed_ok(info), &cmd, iface_desc);
+}
+
+/* Resolve an interface name once so that later requests can use the 
+ * descriptor (or the ifindex) and skip the name lookup.
+ */
+int nl_ts_resolve(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	int iface_desc;
+	int ifindex = 0;
+	struct nl_ts_cmd cmd;
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	struct sk_buff *rskb;
+	void *msg_head;
+	
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL)
+		return -EINVAL;
+	
+	rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+		info->attrs[NL_TS_A_TS_NESTED], 
+		nl_ts_genl_cmd_nested_policy);
+	if (rc != 0)
+		return rc;
+	
+	memset((void *) &cmd, 0, sizeof(cmd));
+	
+	iface_desc = nl_ts_parse_iface(nested, &cmd);
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if (tbl_entry)
+		ifindex = tbl_entry->ifindex;
+	rcu_read_unlock();
+	
+	if (!tbl_entry)
+		return -ENODEV;
+	
+	rskb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (rskb == NULL)
+		return -ENOMEM;
+	
+	msg_head = genlmsg_put(rskb, 0, info->snd_seq, 
+		&nl_ts_gnl_family, 0, NL_TS_C_RESOLVE);
+	if (msg_head == NULL) {
+		rc = -ENOMEM;
+		goto out_free;
+	}
+	
+	rc = nla_put_u32(rskb, NL_TS_A_DESC, (u32) iface_desc);
+	if (rc != 0)
+		goto out_free;
+	
+	if (ifindex) {
+		rc = nla_put_u32(rskb, NL_TS_A_IFINDEX, (u32) ifindex);
+		if (rc != 0)
+			goto out_free;
+	}
+	
+	genlmsg_end(rskb, msg_head);
+	
+	return genlmsg_unicast(genl_info_net(info), rskb, info->snd_portid);
+
+out_free:
+	nlmsg_free(rskb);
+	return rc;
+}
+
+/* Change the capacity and/or overflow policy of one queue. Missing 
+ * attributes keep their current value.
+ */
+int nl_ts_set_queue(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	int iface_desc;
+	u32 cmd_code;
+	u32 capacity;
+	int policy;
+	struct nl_ts_cmd cmd;
+	struct nl_ts_queue *q = NULL;
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL)
+		return -EINVAL;
+	
+	rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+		info->attrs[NL_TS_A_TS_NESTED], 
+		nl_ts_genl_cmd_nested_policy);
+	if (rc != 0)
+		return rc;
+	
+	if (!nested[NL_TS_A_CMD_NESTED_CMD])
+		return -EINVAL;
+	
+	cmd_code = nla_get_u32(nested[NL_TS_A_CMD_NESTED_CMD]);
+	if (cmd_code != MYNL_CMD_GETTS_TX && cmd_code != MYNL_CMD_GETTS_RX)
+		return -EINVAL;
+	
+	memset((void *) &cmd, 0, sizeof(cmd));
+	
+	iface_desc = nl_ts_parse_iface(nested, &cmd);
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if (!tbl_entry) {
+		rc = -ENODEV;
+		goto out_unlock;
+	}
+	
+	if (cmd_code == MYNL_CMD_GETTS_RX)
+		q = &(tbl_entry->rx_queue);
+	else
+		q = &(tbl_entry->tx_queue);
+	
+	capacity = q->capacity;
+	if (nested[NL_TS_A_CMD_NESTED_CAPACITY])
+		capacity = nla_get_u32(nested[NL_TS_A_CMD_NESTED_CAPACITY]);
+	
+	policy = q->policy;
+	if (nested[NL_TS_A_CMD_NESTED_POLICY])
+		policy = (int) nla_get_u32(nested[NL_TS_A_CMD_NESTED_POLICY]);
+	
+	rc = nl_ts_queue_set_limits(q, capacity, policy);
+	
+out_unlock:
+	rcu_read_unlock();
+	return rc;
+}
+
+static bool nl_ts_sub_match(const struct nl_ts_sub *sub, 
+	const struct nl_ts *ts)
+{
+	if (ts->id < sub->id_min || ts->id > sub->id_max)
+		return false;
+	
+	return !sub->valid_only || ts->valid;
+}
+
+/* One NL_TS_C_TS_EVENT message of the n (up to NL_TS_EVENT_MAX_TS) 
+ * timestamps of ts, of those sub wants with sub, NULL when it wants 
+ * none. Its nlmsg_pid is the portid it is for, 0 for the group.
+ */
+static struct sk_buff *nl_ts_event_build(struct nl_ts_coalesce *c, 
+	struct nl_ts *ts, unsigned int n, const struct nl_ts_sub *sub)
+{
+	struct sk_buff *skb;
+	void *msg_head;
+	struct nl_ts ev;
+	unsigned int count = n;
+	unsigned int i;
+	
+	if (sub) {
+		for (i = 0, count = 0; i < n; i++)
+			count += nl_ts_sub_match(sub, &ts[i]);
+		if (count == 0)
+			return NULL;
+	}
+	
+	skb = genlmsg_new(nla_total_size(IFNAME_SIZE) + 
+		count * nl_ts_ts_nested_size(), GFP_ATOMIC);
+	if (skb == NULL)
+		return NULL;
+	
+	msg_head = genlmsg_put(skb, sub ? sub->portid : 0, 0, 
+		&nl_ts_gnl_family, 0, NL_TS_C_TS_EVENT);
+	if (msg_head == NULL)
+		goto out_free;
+	
+	if (nla_put_string(skb, NL_TS_A_IFACE, c->entry->ifname) != 0)
+		goto out_free;
+	
+	for (i = 0; i < n; i++) {
+		if (sub && !nl_ts_sub_match(sub, &ts[i]))
+			continue;
+		ev = ts[i];
+		ev.type = c->type;
+		if (nl_ts_ts_put(skb, &ev) != 0)
+			goto out_free;
+	}
+	
+	genlmsg_end(skb, msg_head);
+	return skb;
+
+out_free:
+	nlmsg_free(skb);
+	return NULL;
+}
+
+/* Sends the events of n (up to NL_TS_EVENT_MAX_TS) timestamps of ts 
+ * to the group, if it has listeners, and to every subscription wanting 
+ * some of them, in its own netns. Subscribers that do not keep up lose 
+ * events, like group members.
+ */
+static void nl_ts_event_send(struct nl_ts_coalesce *c, 
+	struct nl_ts *ts, unsigned int n)
+{
+	struct nl_ts_sub *sub;
+	struct sk_buff *skb;
+	
+	if (genl_has_listeners(&nl_ts_gnl_family, &init_net, c->group)) {
+		skb = nl_ts_event_build(c, ts, n, NULL);
+		if (skb)
+			genlmsg_multicast(&nl_ts_gnl_family, skb, 0, c->group, 
+				GFP_ATOMIC);
+	}
+	
+	if (!READ_ONCE(nl_ts_subs.count))
+		return;
+	
+	/* A subscription holds its netns until it is freed */
+	rcu_read_lock();
+	list_for_each_entry_rcu(sub, &nl_ts_subs.list, node) {
+		if ((sub->desc >= 0 && sub->desc != c->entry->desc) || 
+			!(sub->types & (1U << c->type)))
+			continue;
+		skb = nl_ts_event_build(c, ts, n, sub);
+		if (skb)
+			genlmsg_unicast(sub->net, skb, sub->portid);
+	}
+	rcu_read_unlock();
+}
+
+static bool nl_ts_has_listeners(struct nl_ts_coalesce *c)
+{
+	return READ_ONCE(nl_ts_subs.count) || 
+		genl_has_listeners(&nl_ts_gnl_family, &init_net, c->group);
+}
+
+/* Push n timestamps to the group and subscribers of c, up to 
+ * NL_TS_EVENT_MAX_TS per message. Only called by the push tasklet of c, 
+ * or once it is killed; the skbs are only built when somebody is 
+ * listening.
+ */
+static void nl_ts_notify(struct nl_ts_coalesce *c, struct nl_ts *ts, 
+	unsigned int n)
+{
+	unsigned int i = 0;
+	unsigned int count;
+	
+	if (n == 0 || !nl_ts_has_listeners(c))
+		return;
+	
+	while (i < n) {
+		count = min_t(unsigned int, n - i, NL_TS_EVENT_MAX_TS);
+		nl_ts_event_send(c, ts + i, count);
+		i += count;
+	}
+}
+
+/* Called with lock held once the pending timestamps changed: schedules 
+ * the push when frames of them are pending, else starts the timer for 
+ * the first one. Returns whether the push is due.
+ */
+static int nl_ts_coalesce_arm(struct nl_ts_coalesce *c, int first)
+{
+	if (c->count >= c->frames) {
+		/* Spares a wakeup, a timer past cancelling finds nothing 
+		 * due.
+		 */
+		hrtimer_try_to_cancel(&c->timer.timer);
+		return 1;
+	}
+	
+	if (first && c->count && c->usecs) {
+		c->deadline = ktime_get_ns() + (u64) c->usecs * NSEC_PER_USEC;
+		tasklet_hrtimer_start(&c->timer, 
+			ns_to_ktime((u64) c->usecs * NSEC_PER_USEC), 
+			HRTIMER_MODE_REL);
+	}
+	
+	return 0;
+}
+
+/* Sends what was pending when it started, NL_TS_EVENT_MAX_TS at most 
+ * per round. The slots being sent stay counted so producers do not 
+ * reuse them, and only this tasklet moves first, so the events are 
+ * built from the ring itself without lock.
+ */
+static void nl_ts_coalesce_push(unsigned long data)
+{
+	struct nl_ts_coalesce *c = (struct nl_ts_coalesce *) data;
+	unsigned long flags;
+	unsigned int todo;
+	unsigned int n;
+	int due;
+	
+	spin_lock_irqsave(&c->lock, flags);
+	todo = c->count;
+	spin_unlock_irqrestore(&c->lock, flags);
+	
+	while (todo) {
+		n = min3(todo, (unsigned int) NL_TS_EVENT_MAX_TS, 
+			NL_TS_COALESCE_BACKLOG - c->first);
+		nl_ts_notify(c, &c->pending[c->first], n);
+		todo -= n;
+		
+		spin_lock_irqsave(&c->lock, flags);
+		c->first = (c->first + n) & (NL_TS_COALESCE_BACKLOG - 1);
+		c->count -= n;
+		spin_unlock_irqrestore(&c->lock, flags);
+	}
+	
+	/* Timestamps added meanwhile did not start the timer */
+	spin_lock_irqsave(&c->lock, flags);
+	due = nl_ts_coalesce_arm(c, 1);
+	spin_unlock_irqrestore(&c->lock, flags);
+	
+	if (due)
+		tasklet_schedule(&c->push);
+}
+
+/* Runs in softirq context. The timer of a batch already pushed by 
+ * count may still run, it then waits for the deadline of the new one.
+ */
+static enum hrtimer_restart nl_ts_coalesce_timer(struct hrtimer *timer)
+{
+	struct nl_ts_coalesce *c = container_of(timer, 
+		struct nl_ts_coalesce, timer.timer);
+	unsigned long flags;
+	int due = 0;
+	u64 now;
+	
+	spin_lock_irqsave(&c->lock, flags);
+	if (c->count && c->usecs) {
+		now = ktime_get_ns();
+		if (now >= c->deadline)
+			due = 1;
+		else
+			tasklet_hrtimer_start(&c->timer, 
+				ns_to_ktime(c->deadline - now), 
+				HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&c->lock, flags);
+	
+	if (due)
+		tasklet_schedule(&c->push);
+	
+	return HRTIMER_NORESTART;
+}
+
+/* Hold the n timestamps of ts back for the push tasklet, which is 
+ * scheduled right away unless c moderates the pushes. Safe from hard 
+ * IRQs: nothing is built nor sent here. Timestamps finding the 
+ * backlog full are not pushed.
+ */
+static void nl_ts_coalesce_add(struct nl_ts_coalesce *c, 
+	struct nl_ts *ts, unsigned int n)
+{
+	unsigned long flags;
+	unsigned int i;
+	int due;
+	
+	if (!nl_ts_has_listeners(c))
+		return;
+	
+	spin_lock_irqsave(&c->lock, flags);
+	for (i = 0; i < n && c->count < NL_TS_COALESCE_BACKLOG; i++) {
+		c->pending[(c->first + c->count) & 
+			(NL_TS_COALESCE_BACKLOG - 1)] = ts[i];
+		c->count++;
+	}
+	due = nl_ts_coalesce_arm(c, c->count == i);
+	spin_unlock_irqrestore(&c->lock, flags);
+	
+	if (due)
+		tasklet_schedule(&c->push);
+}
+
+static void nl_ts_coalesce_init(struct nl_ts_coalesce *c, 
+	struct nl_ts_table_entry *entry, int type, int group)
+{
+	spin_lock_init(&c->lock);
+	c->frames = 1;
+	c->type = type;
+	c->group = group;
+	c->entry = entry;
+	tasklet_hrtimer_init(&c->timer, nl_ts_coalesce_timer, 
+		CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tasklet_init(&c->push, nl_ts_coalesce_push, (unsigned long) c);
+}
+
+/* Once no producer can reach the entry any more, pushes what is left */
+static void nl_ts_coalesce_stop(struct nl_ts_coalesce *c)
+{
+	tasklet_hrtimer_cancel(&c->timer);
+	tasklet_kill(&c->push);
+	nl_ts_coalesce_push((unsigned long) c);
+}
+
+/* Change the push moderation of one queue. Missing attributes keep 
+ * their current value. What is held back is pushed as the new settings 
+ * say.
+ */
+int nl_ts_set_coalesce(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	int iface_desc;
+	u32 cmd_code;
+	unsigned long flags;
+	struct nl_ts_cmd cmd;
+	struct nl_ts_coalesce *c = NULL;
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	int due;
+	
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL)
+		return -EINVAL;
+	
+	rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+		info->attrs[NL_TS_A_TS_NESTED], 
+		nl_ts_genl_cmd_nested_policy);
+	if (rc != 0)
+		return rc;
+	
+	if (!nested[NL_TS_A_CMD_NESTED_CMD])
+		return -EINVAL;
+	
+	cmd_code = nla_get_u32(nested[NL_TS_A_CMD_NESTED_CMD]);
+	if (cmd_code != MYNL_CMD_GETTS_TX && cmd_code != MYNL_CMD_GETTS_RX)
+		return -EINVAL;
+	
+	memset((void *) &cmd, 0, sizeof(cmd));
+	
+	iface_desc = nl_ts_parse_iface(nested, &cmd);
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if (!tbl_entry) {
+		rcu_read_unlock();
+		return -ENODEV;
+	}
+	
+	if (cmd_code == MYNL_CMD_GETTS_RX)
+		c = &(tbl_entry->rx_coalesce);
+	else
+		c = &(tbl_entry->tx_coalesce);
+	
+	spin_lock_irqsave(&c->lock, flags);
+	if (nested[NL_TS_A_CMD_NESTED_FRAMES])
+		WRITE_ONCE(c->frames, clamp_t(u32, 
+			nla_get_u32(nested[NL_TS_A_CMD_NESTED_FRAMES]), 
+			1, NL_TS_MAX_COALESCE_FRAMES));
+	if (nested[NL_TS_A_CMD_NESTED_USECS])
+		c->usecs = min_t(u32, 
+			nla_get_u32(nested[NL_TS_A_CMD_NESTED_USECS]), 
+			NL_TS_MAX_COALESCE_USECS);
+	/* A timer left from the old usecs finds nothing due */
+	due = nl_ts_coalesce_arm(c, 1);
+	spin_unlock_irqrestore(&c->lock, flags);
+	
+	if (due)
+		tasklet_schedule(&c->push);
+	rcu_read_unlock();
+	
+	return 0;
+}
+
+static void nl_ts_sub_free_rcu(struct rcu_head *head)
+{
+	struct nl_ts_sub *sub = container_of(head, struct nl_ts_sub, rcu);
+	
+	put_net(sub->net);
+	kfree(sub);
+}
+
+/* Drops the subscriptions of the socket portid in net (of every socket 
+ * with a NULL net) on the interface of desc, or on any with 
+ * NL_TS_SUBS_ALL.
+ */
+static void nl_ts_subs_remove(struct net *net, u32 portid, int desc)
+{
+	struct nl_ts_sub *sub, *tmp;
+	
+	spin_lock(&nl_ts_subs.lock);
+	list_for_each_entry_safe(sub, tmp, &nl_ts_subs.list, node) {
+		if ((net && (!net_eq(sub->net, net) || sub->portid != portid)) || 
+			(desc != NL_TS_SUBS_ALL && sub->desc != desc))
+			continue;
+		list_del_rcu(&sub->node);
+		WRITE_ONCE(nl_ts_subs.count, nl_ts_subs.count - 1);
+		call_rcu(&sub->rcu, nl_ts_sub_free_rcu);
+	}
+	spin_unlock(&nl_ts_subs.lock);
+}
+
+static int nl_ts_has_iface(struct nlattr **nested)
+{
+	return nested[NL_TS_A_CMD_NESTED_IFACE] || 
+		nested[NL_TS_A_CMD_NESTED_DESC] || 
+		nested[NL_TS_A_CMD_NESTED_IFINDEX];
+}
+
+/* Attach a filter to the sender, in place of the one it had on the 
+ * same interface.
+ */
+int nl_ts_subscribe(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	u32 types;
+	struct nl_ts_cmd cmd;
+	struct nl_ts_sub *sub;
+	struct nl_ts_sub *old;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	
+	/* Portid 0 is the kernel, events to it go to the group */
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL || 
+		info->snd_portid == 0)
+		return -EINVAL;
+	
+	rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+		info->attrs[NL_TS_A_TS_NESTED], 
+		nl_ts_genl_cmd_nested_policy);
+	if (rc != 0)
+		return rc;
+	
+	sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+	if (!sub)
+		return -ENOMEM;
+	
+	sub->net = get_net(genl_info_net(info));
+	sub->portid = info->snd_portid;
+	sub->desc = -1;
+	sub->types = (1U << MYNL_CMD_TX_OK_RESP) | (1U << MYNL_CMD_RX_OK_RESP);
+	sub->id_max = U16_MAX;
+	
+	if (nested[NL_TS_A_CMD_NESTED_TYPES]) {
+		types = nla_get_u32(nested[NL_TS_A_CMD_NESTED_TYPES]) & 
+			sub->types;
+		if (types)
+			sub->types = types;
+	}
+	if (nested[NL_TS_A_CMD_NESTED_ID_MIN])
+		sub->id_min = nla_get_u16(nested[NL_TS_A_CMD_NESTED_ID_MIN]);
+	if (nested[NL_TS_A_CMD_NESTED_ID_MAX])
+		sub->id_max = nla_get_u16(nested[NL_TS_A_CMD_NESTED_ID_MAX]);
+	if (nested[NL_TS_A_CMD_NESTED_VALID])
+		sub->valid_only = !!nla_get_u32(nested[NL_TS_A_CMD_NESTED_VALID]);
+	
+	if (sub->id_min > sub->id_max) {
+		rc = -EINVAL;
+		goto out_free;
+	}
+	
+	memset((void *) &cmd, 0, sizeof(cmd));
+	
+	/* Under the table lock, unregistering the interface drops the 
+	 * subscription afterwards.
+	 */
+	mutex_lock(&nl_ts_tbl.lock);
+	if (nl_ts_has_iface(nested)) {
+		sub->desc = nl_ts_parse_iface(nested, &cmd);
+		if (sub->desc < 0 || !idr_find(&nl_ts_tbl.descs, sub->desc)) {
+			rc = -ENODEV;
+			goto out_unlock;
+		}
+	}
+	
+	spin_lock(&nl_ts_subs.lock);
+	list_for_each_entry(old, &nl_ts_subs.list, node) {
+		if (net_eq(old->net, sub->net) && old->portid == sub->portid && 
+			old->desc == sub->desc) {
+			list_replace_rcu(&old->node, &sub->node);
+			call_rcu(&old->rcu, nl_ts_sub_free_rcu);
+			sub = NULL;
+			break;
+		}
+	}
+	if (sub && nl_ts_subs.count >= NL_TS_MAX_SUBS) {
+		rc = -ENOSPC;
+	} else if (sub) {
+		list_add_tail_rcu(&sub->node, &nl_ts_subs.list);
+		WRITE_ONCE(nl_ts_subs.count, nl_ts_subs.count + 1);
+		sub = NULL;
+	}
+	spin_unlock(&nl_ts_subs.lock);
+
+out_unlock:
+	mutex_unlock(&nl_ts_tbl.lock);
+out_free:
+	if (sub) {
+		put_net(sub->net);
+		kfree(sub);
+	}
+	return rc;
+}
+
+/* Drop the subscription of the sender on the named interface, or all 
+ * of them.
+ */
+int nl_ts_unsubscribe(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	int desc = NL_TS_SUBS_ALL;
+	struct nl_ts_cmd cmd;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	
+	if (info == NULL)
+		return -EINVAL;
+	
+	if (info->attrs[NL_TS_A_TS_NESTED]) {
+		rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+			info->attrs[NL_TS_A_TS_NESTED], 
+			nl_ts_genl_cmd_nested_policy);
+		if (rc != 0)
+			return rc;
+		
+		memset((void *) &cmd, 0, sizeof(cmd));
+		if (nl_ts_has_iface(nested)) {
+			desc = nl_ts_parse_iface(nested, &cmd);
+			if (desc < 0)
+				return -ENODEV;
+		}
+	}
+	
+	nl_ts_subs_remove(genl_info_net(info), info->snd_portid, desc);
+	
+	return 0;
+}
+
+/* Subscriptions of closed sockets */
+static int nl_ts_netlink_event(struct notifier_block *nb, 
+	unsigned long event, void *ptr)
+{
+	struct netlink_notify *n = ptr;
+	
+	if (event == NETLINK_URELEASE && n->protocol == NETLINK_GENERIC && 
+		n->portid)
+		nl_ts_subs_remove(n->net, n->portid, NL_TS_SUBS_ALL);
+	
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block nl_ts_netlink_notifier = {
+	.notifier_call = nl_ts_netlink_event,
+};
+
+static int nl_ts_stats_put(struct sk_buff *skb, struct nl_ts_queue *q, 
+	int type)
+{
+	struct nl_ts_queue_stats stats;
+	struct nlattr *na;
+	
+	nl_ts_queue_get_stats(q, &stats);
+	
+	na = nla_nest_start(skb, NL_TS_A_STATS);
+	if (!na)
+		return -EMSGSIZE;
+	
+	if (nla_put_u32(skb, NL_TS_A_STATS_TYPE, (u32) type) ||
+		nla_put_u64(skb, NL_TS_A_STATS_ENQUEUED, stats.enqueued) ||
+		nla_put_u64(skb, NL_TS_A_STATS_DEQUEUED, stats.dequeued) ||
+		nla_put_u64(skb, NL_TS_A_STATS_DROPPED, stats.dropped) ||
+		nla_put_u64(skb, NL_TS_A_STATS_EMPTY_POLLS, stats.empty_polls) ||
+		nla_put_u32(skb, NL_TS_A_STATS_DEPTH, stats.depth) ||
+		nla_put_u32(skb, NL_TS_A_STATS_HIGH_WATERMARK, 
+			stats.high_watermark) ||
+		nla_put_u32(skb, NL_TS_A_STATS_CAPACITY, stats.capacity) ||
+		nla_put_u32(skb, NL_TS_A_STATS_POLICY, (u32) stats.policy)) {
+		nla_nest_cancel(skb, na);
+		return -EMSGSIZE;
+	}
+	
+	nla_nest_end(skb, na);
+	return 0;
+}
+
+static int nl_ts_hist_put(struct sk_buff *skb, struct nl_ts_queue *q, 
+	int type)
+{
+	u64 buckets[NL_TS_HIST_BUCKETS];
+	struct nlattr *na;
+	struct nlattr *nb;
+	int i;
+	
+	nl_ts_queue_get_hist(q, buckets);
+	
+	na = nla_nest_start(skb, NL_TS_A_HIST);
+	if (!na)
+		return -EMSGSIZE;
+	
+	if (nla_put_u32(skb, NL_TS_A_HIST_TYPE, (u32) type))
+		goto cancel;
+	
+	nb = nla_nest_start(skb, NL_TS_A_HIST_BUCKETS);
+	if (!nb)
+		goto cancel;
+	
+	for (i = 0; i < NL_TS_HIST_BUCKETS; i++) {
+		if (buckets[i] && nla_put_u64(skb, i + 1, buckets[i]))
+			goto cancel;
+	}
+	
+	nla_nest_end(skb, nb);
+	nla_nest_end(skb, na);
+	return 0;
+
+cancel:
+	nla_nest_cancel(skb, na);
+	return -EMSGSIZE;
+}
+
+/* One NL_TS_C_GET_STATS or NL_TS_C_GET_HIST message for tbl_entry, 
+ * called under RCU.
+ */
+static int nl_ts_stats_fill(struct sk_buff *skb, u32 portid, u32 seq, 
+	int flags, struct nl_ts_table_entry *tbl_entry, u8 cmd)
+{
+	int (*put)(struct sk_buff *, struct nl_ts_queue *, int);
+	void *msg_head;
+	
+	put = (cmd == NL_TS_C_GET_HIST) ? nl_ts_hist_put : nl_ts_stats_put;
+	
+	msg_head = genlmsg_put(skb, portid, seq, 
+		&nl_ts_gnl_family, flags, cmd);
+	if (msg_head == NULL)
+		return -EMSGSIZE;
+	
+	if (nla_put_string(skb, NL_TS_A_IFACE, tbl_entry->ifname) ||
+		nla_put_u32(skb, NL_TS_A_DESC, (u32) tbl_entry->desc) ||
+		put(skb, &tbl_entry->tx_queue, MYNL_CMD_GETTS_TX) ||
+		put(skb, &tbl_entry->rx_queue, MYNL_CMD_GETTS_RX)) {
+		genlmsg_cancel(skb, msg_head);
+		return -EMSGSIZE;
+	}
+	
+	genlmsg_end(skb, msg_head);
+	return 0;
+}
+
+int nl_ts_get_stats(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	int iface_desc;
+	struct nl_ts_cmd cmd;
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	struct sk_buff *rskb;
+	
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL)
+		return -EINVAL;
+	
+	rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+		info->attrs[NL_TS_A_TS_NESTED], 
+		nl_ts_genl_cmd_nested_policy);
+	if (rc != 0)
+		return rc;
+	
+	memset((void *) &cmd, 0, sizeof(cmd));
+	
+	iface_desc = nl_ts_parse_iface(nested, &cmd);
+	
+	rskb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (rskb == NULL)
+		return -ENOMEM;
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if (tbl_entry)
+		rc = nl_ts_stats_fill(rskb, info->snd_portid, info->snd_seq, 
+			0, tbl_entry, info->genlhdr->cmd);
+	else
+		rc = -ENODEV;
+	rcu_read_unlock();
+	
+	if (rc != 0) {
+		nlmsg_free(rskb);
+		return rc;
+	}
+	
+	return genlmsg_unicast(genl_info_net(info), rskb, info->snd_portid);
+}
+
+/* Dumps NL_TS_C_GET_STATS and NL_TS_C_GET_HIST, cb->args[0] is the 
+ * next descriptor to dump.
+ */
+int nl_ts_dump_stats(struct sk_buff *skb, struct netlink_callback *cb) {
+	struct genlmsghdr *gnlh = nlmsg_data(cb->nlh);
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	int desc;
+	
+	rcu_read_lock();
+	desc = cb->args[0];
+	for (;;) {
+		tbl_entry = idr_get_next(&nl_ts_tbl.descs, &desc);
+		if (!tbl_entry)
+			break;
+		
+		if (nl_ts_stats_fill(skb, NETLINK_CB(cb->skb).portid, 
+			cb->nlh->nlmsg_seq, NLM_F_MULTI, tbl_entry, 
+			gnlh->cmd) != 0)
+			break;
+		desc++;
+	}
+	rcu_read_unlock();
+	
+	cb->args[0] = desc;
+	
+	return skb->len;
+}
+
+int nl_ts_reset_hist(struct sk_buff *skb, struct genl_info *info) {
+	int rc;
+	int iface_desc;
+	int type = -1;
+	struct nl_ts_cmd cmd;
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nlattr *nested[NL_TS_A_CMD_NESTED_MAX+1];
+	
+	if (info == NULL || info->attrs[NL_TS_A_TS_NESTED] == NULL)
+		return -EINVAL;
+	
+	rc = nla_parse_nested(nested, NL_TS_A_CMD_NESTED_MAX, 
+		info->attrs[NL_TS_A_TS_NESTED], 
+		nl_ts_genl_cmd_nested_policy);
+	if (rc != 0)
+		return rc;
+	
+	if (nested[NL_TS_A_CMD_NESTED_CMD])
+		type = (int) nla_get_u32(nested[NL_TS_A_CMD_NESTED_CMD]);
+	
+	memset((void *) &cmd, 0, sizeof(cmd));
+	
+	iface_desc = nl_ts_parse_iface(nested, &cmd);
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if (tbl_entry) {
+		if (type != MYNL_CMD_GETTS_RX)
+			nl_ts_queue_reset_hist(&tbl_entry->tx_queue);
+		if (type != MYNL_CMD_GETTS_TX)
+			nl_ts_queue_reset_hist(&tbl_entry->rx_queue);
+	}
+	rcu_read_unlock();
+	
+	return tbl_entry ? 0 : -ENODEV;
+}
+
+/* Only commands userspace can send have ops; NL_TS_C_TS_EVENT is 
+ * kernel to user only.
+ */
+struct genl_ops nl_ts_gnl_ops[] = {
+		{
+			.cmd = NL_TS_C_GETTS,
+			.flags = 0,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_getts,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_GETTS_BATCH,
+			.flags = 0,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_getts_batch,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_GETTS_ID,
+			.flags = 0,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_getts_id,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_RESOLVE,
+			.flags = 0,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_resolve,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_SET_QUEUE,
+			.flags = GENL_ADMIN_PERM,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_set_queue,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_SET_COALESCE,
+			.flags = GENL_ADMIN_PERM,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_set_coalesce,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_SUBSCRIBE,
+			.flags = GENL_ADMIN_PERM,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_subscribe,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_UNSUBSCRIBE,
+			.flags = 0,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_unsubscribe,
+			.dumpit = NULL,
+		},
+		{
+			.cmd = NL_TS_C_GET_STATS,
+			.flags = 0,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_get_stats,
+			.dumpit = nl_ts_dump_stats,
+		},
+		{
+			.cmd = NL_TS_C_GET_HIST,
+			.flags = 0,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_get_stats,
+			.dumpit = nl_ts_dump_stats,
+		},
+		{
+			.cmd = NL_TS_C_RESET_HIST,
+			.flags = GENL_ADMIN_PERM,
+			.policy = nl_ts_genl_policy,
+			.doit = nl_ts_reset_hist,
+			.dumpit = NULL,
+		},
+};
+
+int nl_ts_iface_tx_ts_add(int iface_desc, struct nl_ts *ts)
+{
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nl_ts_queue * ts_q = NULL;
+	int rc;
+	
+	if(!ts)
+		return -EINVAL;
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if(!tbl_entry) {
+		rcu_read_unlock();
+		return -ENODEV;
+	}
+	
+	/* Lock-free, the timestamp goes to this CPU's stage */
+	ts_q = &(tbl_entry->tx_queue);
+	rc = nl_ts_queue_enqueue(ts_q,ts);
+	if(rc >= 0) {
+		nl_ts_waiters_kick(&tbl_entry->tx_waiters);
+		nl_ts_coalesce_add(&tbl_entry->tx_coalesce, ts, 1);
+	}
+	rcu_read_unlock();
+		
+	return rc;
+}
+EXPORT_SYMBOL(nl_ts_iface_tx_ts_add);
+
+int nl_ts_iface_rx_ts_add(int iface_desc, struct nl_ts *ts)
+{
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nl_ts_queue * ts_q = NULL;
+	int rc;
+	
+	if(!ts)
+		return -EINVAL;
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if(!tbl_entry) {
+		rcu_read_unlock();
+		return -ENODEV;
+	}
+	
+	/* Lock-free, the timestamp goes to this CPU's stage */
+	ts_q = &(tbl_entry->rx_queue);
+	rc = nl_ts_queue_enqueue(ts_q,ts);
+	if(rc >= 0) {
+		nl_ts_waiters_kick(&tbl_entry->rx_waiters);
+		nl_ts_coalesce_add(&tbl_entry->rx_coalesce, ts, 1);
+	}
+	rcu_read_unlock();
+		
+	return rc;
+}
+EXPORT_SYMBOL(nl_ts_iface_rx_ts_add);
+
+/* One lookup, one IRQ-disabled section and as few events as possible 
+ * for the whole burst.
+ */
+static int nl_ts_iface_ts_add_bulk(int iface_desc, struct nl_ts *ts, 
+	unsigned int n, int type)
+{
+	struct nl_ts_table_entry * tbl_entry = NULL;
+	struct nl_ts_queue * ts_q = NULL;
+	struct nl_ts_coalesce *c;
+	int rc;
+	
+	if(!ts)
+		return -EINVAL;
+	
+	if(n == 0)
+		return 0;
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(iface_desc);
+	if(!tbl_entry) {
+		rcu_read_unlock();
+		return -ENODEV;
+	}
+	
+	if(type == MYNL_CMD_TX_OK_RESP) {
+		ts_q = &(tbl_entry->tx_queue);
+		c = &(tbl_entry->tx_coalesce);
+	} else {
+		ts_q = &(tbl_entry->rx_queue);
+		c = &(tbl_entry->rx_coalesce);
+	}
+	rc = nl_ts_queue_enqueue_bulk(ts_q, ts, n);
+	if(rc > 0) {
+		nl_ts_waiters_kick(nl_ts_waiters_get(tbl_entry, type));
+		/* The queued ones are the first rc */
+		nl_ts_coalesce_add(c, ts, rc);
+	}
+	rcu_read_unlock();
+	
+	return rc;
+}
+
+int nl_ts_iface_tx_ts_add_bulk(int iface_desc, struct nl_ts *ts, 
+	unsigned int n)
+{
+	return nl_ts_iface_ts_add_bulk(iface_desc, ts, n, MYNL_CMD_TX_OK_RESP);
+}
+EXPORT_SYMBOL(nl_ts_iface_tx_ts_add_bulk);
+
+int nl_ts_iface_rx_ts_add_bulk(int iface_desc, struct nl_ts *ts, 
+	unsigned int n)
+{
+	return nl_ts_iface_ts_add_bulk(iface_desc, ts, n, MYNL_CMD_RX_OK_RESP);
+}
+EXPORT_SYMBOL(nl_ts_iface_rx_ts_add_bulk);
+
+struct nl_ts_queue_map *nl_ts_iface_map_attach(const char *ifname, 
+	int type)
+{
+	struct nl_ts_table_entry * tbl_entry  = NULL;
+	struct nl_ts_queue_map *map = NULL;
+	int desc;
+	
+	desc = nl_ts_table_entry_get_by_ifname(ifname);
+	
+	rcu_read_lock();
+	tbl_entry = nl_ts_table_entry_get(desc);
+	if(!tbl_entry) {
+		rcu_read_unlock();
+		return ERR_PTR(-ENODEV);
+	}
+	
+	if(type == MYNL_CMD_GETTS_TX)
+		map = nl_ts_queue_map_attach(&tbl_entry->tx_queue);
+	else
+		map = nl_ts_queue_map_attach(&tbl_entry->rx_queue);
+	rcu_read_unlock();
+	
+	if(!map)
+		return ERR_PTR(-EBUSY);
+	
+	return map;
+}
+
+int nl_ts_iface_register_capacity(const char *iface, 
+	unsigned int capacity, int policy)
+{
+	struct nl_ts_table_entry * tbl_entry  = NULL;
+	struct net_device *dev;
+	int desc;
+	int rc;
+	
+	if(capacity < 1 || capacity > NL_TS_QUEUE_MAX_SIZE || 
+		policy < 0 || policy > NL_TS_POLICY_MAX)
+		return -EINVAL;
+	
+	tbl_entry = kzalloc(sizeof(*tbl_entry), GFP_KERNEL);
+	if(!tbl_entry)
+		return -ENOMEM;
+	
+	/* The rings are allocated here so producers never allocate */
+	rc = nl_ts_queue_init(&tbl_entry->tx_queue, capacity);
+	if(rc == 0)
+		rc = nl_ts_queue_init(&tbl_entry->rx_queue, capacity);
+	if(rc != 0)
+		goto failure;
+	
+	nl_ts_queue_set_limits(&tbl_entry->tx_queue, capacity, policy);
+	nl_ts_queue_set_limits(&tbl_entry->rx_queue, capacity, policy);
+	
+	nl_ts_waiters_init(&tbl_entry->tx_waiters, &tbl_entry->tx_queue);
+	nl_ts_waiters_init(&tbl_entry->rx_waiters, &tbl_entry->rx_queue);
+	
+	strncpy(tbl_entry->ifname, iface, IFNAME_SIZE - 1);
+	
+	nl_ts_coalesce_init(&tbl_entry->tx_coalesce, tbl_entry, 
+		MYNL_CMD_TX_OK_RESP, NL_TS_MCGRP_TX);
+	nl_ts_coalesce_init(&tbl_entry->rx_coalesce, tbl_entry, 
+		MYNL_CMD_RX_OK_RESP, NL_TS_MCGRP_RX);
+	
+	dev = dev_get_by_name(&init_net, iface);
+	if(dev) {
+		tbl_entry->ifindex = dev->ifindex;
+		dev_put(dev);
+	}
+	
+	/* The descriptor is reserved empty, and the entry published once 
+	 * it knows its descriptor.
+	 */
+	mutex_lock(&nl_ts_tbl.lock);
+	desc = idr_alloc(&nl_ts_tbl.descs, NULL, 0, 0, GFP_KERNEL);
+	if(desc >= 0) {
+		tbl_entry->desc = desc;
+		hash_add_rcu(nl_ts_tbl.name_hash, &tbl_entry->name_node, 
+			nl_ts_name_hash(tbl_entry->ifname));
+		if(tbl_entry->ifindex)
+			hash_add_rcu(nl_ts_tbl.ifindex_hash, 
+				&tbl_entry->ifindex_node, tbl_entry->ifindex);
+		idr_replace(&nl_ts_tbl.descs, tbl_entry, desc);
+	}
+	mutex_unlock(&nl_ts_tbl.lock);
+	
+	if(desc < 0) {
+		rc = desc;
+		goto failure;
+	}
+	
+	return desc;
+
+failure:
+	nl_ts_queue_kfree(&tbl_entry->tx_queue);
+	nl_ts_queue_kfree(&tbl_entry->rx_queue);
+	kfree(tbl_entry);
+	return rc;
+}
+EXPORT_SYMBOL(nl_ts_iface_register_capacity);
+
+int nl_ts_iface_register(const char *iface)
+{
+	return nl_ts_iface_register_capacity(iface, NL_TS_QUEUE_SIZE, 
+		NL_TS_POLICY_DROP_NEWEST);
+}
+EXPORT_SYMBOL(nl_ts_iface_register);
+
+int nl_ts_iface_unregister(int iface_desc)
+{
+	struct nl_ts_table_entry * tbl_entry  = NULL;
+	
+	if (iface_desc < 0)
+		return -1;
+	
+	mutex_lock(&nl_ts_tbl.lock);
+	tbl_entry = idr_find(&nl_ts_tbl.descs, iface_desc);
+	if(tbl_entry) {
+		idr_remove(&nl_ts_tbl.descs, iface_desc);
+		hash_del_rcu(&tbl_entry->name_node);
+		if(tbl_entry->ifindex)
+			hash_del_rcu(&tbl_entry->ifindex_node);
+	}
+	mutex_unlock(&nl_ts_tbl.lock);
+	
+	if(!tbl_entry)
+		return 0;
+	
+	/* Its descriptor may be reused by the next interface */
+	nl_ts_subs_remove(NULL, 0, iface_desc);
+	
+	/* Wait for producers and consumers still using the entry */
+	synchronize_rcu();
+	
+	nl_ts_waiters_stop(&tbl_entry->tx_waiters);
+	nl_ts_waiters_stop(&tbl_entry->rx_waiters);
+	nl_ts_coalesce_stop(&tbl_entry->tx_coalesce);
+	nl_ts_coalesce_stop(&tbl_entry->rx_coalesce);
+	
+	nl_ts_queue_kfree(&tbl_entry->tx_queue);
+	nl_ts_queue_kfree(&tbl_entry->rx_queue);
+	kfree(tbl_entry);
+	
+	return 0;
+}
+EXPORT_SYMBOL(nl_ts_iface_unregister);
+
+static int __init nl_ts_module_init(void) {
+	int rc;
+	struct genl_ops * ops = nl_ts_gnl_ops;
+	
+	idr_init(&nl_ts_tbl.descs);
+	hash_init(nl_ts_tbl.name_hash);
+	hash_init(nl_ts_tbl.ifindex_hash);
+	mutex_init(&nl_ts_tbl.lock);
+	INIT_LIST_HEAD(&nl_ts_subs.list);
+	spin_lock_init(&nl_ts_subs.lock);
+	
+	rc = nl_ts_mmap_init();
+	if (rc != 0) {
+		goto failure;
+	}
+	
+	// Fill the family ops
+	nl_ts_gnl_family.ops = ops;
+	nl_ts_gnl_family.n_ops = ARRAY_SIZE(nl_ts_gnl_ops);
+	nl_ts_gnl_family.mcgrps = nl_ts_mcgrps;
+	nl_ts_gnl_family.n_mcgrps = ARRAY_SIZE(nl_ts_mcgrps);
+	
+	netlink_register_notifier(&nl_ts_netlink_notifier);
+	
+	// Register the family
+	rc = genl_register_family(&nl_ts_gnl_family);
+	if (rc != 0) {
+		goto failure_notifier;
+	}
+	
+	printk("Installed the Netlink TS family. \n");
+
+	return 0; 
+failure_notifier:
+	netlink_unregister_notifier(&nl_ts_netlink_notifier);
+	nl_ts_mmap_exit();
+failure:
+	printk("Error registering the Netlink TS family. \n");
+	return -1;
+}
+
+static void __exit nl_ts_module_exit(void) {
+	struct nl_ts_table_entry * tbl_entry  = NULL;
+	int ret;
+	int desc;
+	
+	nl_ts_mmap_exit();
+	
+	//Unregister the family
+	ret = genl_unregister_family(&nl_ts_gnl_family);
 	if(ret !=0) {
 		printk("Error unregistering the Netlink TS family. \n");
 	}
 	
+	netlink_unregister_notifier(&nl_ts_netlink_notifier);
+	nl_ts_subs_remove(NULL, 0, NL_TS_SUBS_ALL);
+	
+	idr_for_each_entry(&nl_ts_tbl.descs, tbl_entry, desc)
+		nl_ts_iface_unregister(desc);
+	idr_destroy(&nl_ts_tbl.descs);
+	
+	/* Subscriptions are freed by call_rcu() callbacks of this module */
+	rcu_barrier();
+	
+	if(nl_ts_queue_mem_usage() != 0)
+		printk("Netlink TS queues leaked %ld bytes. \n",
+			nl_ts_queue_mem_usage());
+	
 	printk("Removed the Netlink TS family. \n");
 }
 
@@ -3,10 +3,36 @@
 
 #include "nl_ts_queue.h"
 
+/* Return 0 when the timestamp was queued, NL_TS_QUEUE_OVERWROTE when 
+ * it was but older ones were evicted, -ENOSPC when the queue was full 
+ * and it was dropped, -ENODEV for an unknown descriptor. Callable from 
+ * any context, hard IRQs included: pushes to listeners are only 
+ * scheduled here and sent from a tasklet.
+ */
 extern int nl_ts_iface_tx_ts_add(int iface_desc, struct nl_ts *ts);
 extern int nl_ts_iface_rx_ts_add(int iface_desc, struct nl_ts *ts);
 
+/* For drivers completing timestamps in bursts: the n timestamps of ts 
+ * are queued with one lookup and one IRQ-disabled section. Return how 
+ * many were queued, from the first one, the others were dropped, or 
+ * -ENODEV for an unknown descriptor.
+ */
+extern int nl_ts_iface_tx_ts_add_bulk(int iface_desc, struct nl_ts *ts, 
+	unsigned int n);
+extern int nl_ts_iface_rx_ts_add_bulk(int iface_desc, struct nl_ts *ts, 
+	unsigned int n);
+
+/* Allocates the interface rings, may sleep. Both queues hold at most 
+ * capacity (1..NL_TS_QUEUE_MAX_SIZE) timestamps, their rings capacity 
+ * rounded up to a power of two, policy is one of NL_TS_POLICY_*. 
+ * nl_ts_iface_register() uses NL_TS_QUEUE_SIZE and 
+ * NL_TS_POLICY_DROP_NEWEST. Return the descriptor, -EINVAL for a bad 
+ * capacity or policy or -ENOMEM.
+ */
+extern int nl_ts_iface_register_capacity(const char *iface, 
+	unsigned int capacity, int policy);
 extern int nl_ts_iface_register(const char *iface);
+/* Waits for an RCU grace period, may sleep */
 extern int nl_ts_iface_unregister(int iface_desc);
 
 #endif /* __NL_TS_MODULE_H__ */
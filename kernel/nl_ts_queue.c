@@ -1,74 +1,727 @@
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/jhash.h>
+
 #include "nl_ts_queue.h"
 
-struct nl_ts_queue_element * nl_ts_queue_kmalloc(struct nl_ts *ts)
+/* Bytes held by all queue storage, see nl_ts_queue_mem_usage() */
+static atomic_long_t nl_ts_queue_mem = ATOMIC_LONG_INIT(0);
+
+long nl_ts_queue_mem_usage(void)
 {
-	struct nl_ts_queue_element *qe = NULL;
+	return atomic_long_read(&nl_ts_queue_mem);
+}
+
+static void nl_ts_queue_map_release(struct kref *ref)
+{
+	struct nl_ts_queue_map *map = container_of(ref, 
+		struct nl_ts_queue_map, ref);
 	
-	qe = kmalloc(sizeof(struct nl_ts_queue_element),
-			GFP_ATOMIC);
-	if(!qe)
-		return NULL;
+	atomic_long_sub(map->size, &nl_ts_queue_mem);
+	vfree(map->hdr);
+	kfree(map);
+}
+
+static void nl_ts_queue_flush(struct irq_work *work);
+
+static size_t nl_ts_queue_percpu_bytes(void)
+{
+	return nr_cpu_ids * (sizeof(struct nl_ts_queue_stage) + 
+		sizeof(struct nl_ts_queue_counters));
+}
+
+/* Of the index and the taken bitmap of a ring of size slots */
+static size_t nl_ts_queue_index_bytes(u32 size)
+{
+	return NL_TS_INDEX_PER_SLOT * size * sizeof(u32) + 
+		BITS_TO_LONGS(size) * sizeof(long);
+}
+
+/* The ring gets capacity (1..NL_TS_QUEUE_MAX_SIZE) rounded up to a 
+ * power of two slots, which bounds the capacity for good.
+ */
+int nl_ts_queue_init(struct nl_ts_queue *q, u32 capacity)
+{
+	struct nl_ts_queue_map *map;
+	struct nl_ts_ring_hdr *hdr;
+	u32 size;
+	
+	if (capacity < 1 || capacity > NL_TS_QUEUE_MAX_SIZE)
+		return -EINVAL;
+	size = roundup_pow_of_two(capacity);
+	
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if(!map)
+		return -ENOMEM;
+	
+	/* vmalloc_user() memory is zeroed and can be mapped to userspace */
+	map->size = PAGE_SIZE + 
+		PAGE_ALIGN(size * sizeof(struct nl_ts_queue_element));
+	map->hdr = vmalloc_user(map->size);
+	if(!map->hdr)
+		goto out_map;
+	
+	q->stage = alloc_percpu(struct nl_ts_queue_stage);
+	if(!q->stage)
+		goto out_hdr;
+	
+	q->counters = alloc_percpu(struct nl_ts_queue_counters);
+	if(!q->counters)
+		goto out_stage;
+	
+	q->pending = kcalloc(nr_cpu_ids, sizeof(*q->pending), GFP_KERNEL);
+	if(!q->pending)
+		goto out_counters;
+	
+	q->index = kcalloc(NL_TS_INDEX_PER_SLOT * size, sizeof(*q->index), 
+		GFP_KERNEL);
+	if(!q->index)
+		goto out_pending;
+	
+	q->taken = kcalloc(BITS_TO_LONGS(size), sizeof(*q->taken), GFP_KERNEL);
+	if(!q->taken)
+		goto out_index;
+	
+	kref_init(&map->ref);
+	atomic_set(&map->attached, 0);
+	init_waitqueue_head(&map->wait);
+	atomic_long_add(map->size + nl_ts_queue_percpu_bytes() + 
+		nl_ts_queue_index_bytes(size), &nl_ts_queue_mem);
+	
+	hdr = map->hdr;
+	hdr->magic = NL_TS_RING_MAGIC;
+	hdr->version = NL_TS_RING_VERSION;
+	hdr->size = size;
+	hdr->slot_size = sizeof(struct nl_ts_queue_element);
+	hdr->data_offset = PAGE_SIZE;
+	
+	q->map = map;
+	q->hdr = hdr;
+	q->ring = (struct nl_ts_queue_element *) 
+		((char *) hdr + hdr->data_offset);
+	q->mask = size - 1;
+	q->index_mask = NL_TS_INDEX_PER_SLOT * size - 1;
+	q->capacity = capacity;
+	q->policy = NL_TS_POLICY_DROP_NEWEST;
+	q->high_watermark = 0;
+	spin_lock_init(&q->lock);
+	init_irq_work(&q->flush_work, nl_ts_queue_flush);
+	
+	return 0;
+
+out_index:
+	kfree(q->index);
+	q->index = NULL;
+out_pending:
+	kfree(q->pending);
+	q->pending = NULL;
+out_counters:
+	free_percpu(q->counters);
+	q->counters = NULL;
+out_stage:
+	free_percpu(q->stage);
+	q->stage = NULL;
+out_hdr:
+	vfree(map->hdr);
+out_map:
+	kfree(map);
+	return -ENOMEM;
+}
+
+static u32 nl_ts_queue_hash(struct nl_ts_queue *q, u16 id, u64 seq)
+{
+	return jhash_2words((u32) seq, (u32) (seq >> 32) ^ id, 0) & 
+		q->index_mask;
+}
+
+static int nl_ts_queue_stage_empty(struct nl_ts_queue_stage *st)
+{
+	return st->tail == smp_load_acquire(&st->head);
+}
+
+static u64 nl_ts_queue_stage_seq(struct nl_ts_queue_stage *st)
+{
+	return st->slots[st->tail & (NL_TS_STAGE_SIZE - 1)].ts.seq;
+}
+
+/* Make room for one timestamp in a ring holding head - tail of them, 
+ * by evicting the oldest. head must already be published so that the 
+ * consumer never sees tail ahead of it. Returns 1 if a timestamp was 
+ * evicted, 0 if the consumer took it first, making the room for us.
+ */
+static int nl_ts_queue_evict(struct nl_ts_queue *q, u32 tail)
+{
+	if (cmpxchg(&q->hdr->tail, tail, tail + 1) != tail)
+		return 0;
+	
+	/* Already handed out by nl_ts_queue_take() */
+	if (test_bit(tail & q->mask, q->taken))
+		return 0;
+	
+	__this_cpu_inc(q->counters->dropped);
+	return 1;
+}
+
+/* Move staged timestamps into the shared ring, oldest seq first, until 
+ * the stages are empty or the ring holds q->capacity timestamps, unless 
+ * the policy lets older ones be evicted. Called with q->lock held and 
+ * IRQs disabled. Returns the number of evicted timestamps.
+ */
+static u32 nl_ts_queue_collect(struct nl_ts_queue *q)
+{
+	struct nl_ts_ring_hdr *hdr = q->hdr;
+	struct nl_ts_queue_stage *st;
+	struct nl_ts_queue_element *qe;
+	u32 evicted = 0;
+	u32 depth;
+	u32 head = hdr->head;
+	u32 tail = smp_load_acquire(&hdr->tail);
+	int n = 0;
+	int i, min;
+	int cpu;
+	
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(q->stage, cpu);
+		if (!nl_ts_queue_stage_empty(st))
+			q->pending[n++] = st;
+	}
+	
+	while (n > 0) {
+		if (head - tail >= q->capacity) {
+			tail = smp_load_acquire(&hdr->tail);
+			
+			/* Also catches a bogus tail written by a mapped consumer */
+			if (head - tail > q->mask + 1)
+				break;
 			
-	(qe->ts).sec = ts->sec;
-	(qe->ts).nsec = ts->nsec;
-	(qe->ts).valid = ts->valid;
-	(qe->ts).type = ts->type;
-	(qe->ts).seq = ts->seq;
-	(qe->ts).id = ts->id;
-	(qe->ts).ahead = ts->ahead;
+			if (head - tail >= q->capacity) {
+				if (q->policy != NL_TS_POLICY_DROP_OLDEST)
+					break;
+				
+				smp_store_release(&hdr->head, head);
+				evicted += nl_ts_queue_evict(q, tail);
+				tail = smp_load_acquire(&hdr->tail);
+				continue;
+			}
+		}
+		
+		min = 0;
+		for (i = 1; i < n; i++) {
+			if (nl_ts_queue_stage_seq(q->pending[i]) < 
+				nl_ts_queue_stage_seq(q->pending[min]))
+				min = i;
+		}
+		
+		st = q->pending[min];
+		qe = &st->slots[st->tail & (NL_TS_STAGE_SIZE - 1)];
+		q->ring[head & q->mask] = *qe;
+		__clear_bit(head & q->mask, q->taken);
+		q->index[nl_ts_queue_hash(q, qe->ts.id, qe->ts.seq)] = head;
+		head++;
+		
+		/* The producer may reuse the stage slot from now on */
+		smp_store_release(&st->tail, st->tail + 1);
+		
+		if (nl_ts_queue_stage_empty(st))
+			q->pending[min] = q->pending[--n];
+	}
+	
+	/* Publish the slots before the new head */
+	smp_store_release(&hdr->head, head);
 	
-	return qe;
+	depth = head - smp_load_acquire(&hdr->tail);
+	if (depth > q->high_watermark && depth <= q->mask + 1)
+		q->high_watermark = depth;
+	
+	return evicted;
 }
 
-void nl_ts_queue_init(struct nl_ts_queue *q)
+/* Runs on the producing CPU while a mapping is attached, so that its 
+ * consumer sees staged timestamps without any syscall.
+ */
+static void nl_ts_queue_flush(struct irq_work *work)
 {
-	INIT_LIST_HEAD(&q->queue);
-	spin_lock_init(&q->lock);
+	struct nl_ts_queue *q = container_of(work, 
+		struct nl_ts_queue, flush_work);
+	
+	spin_lock(&q->lock);
+	nl_ts_queue_collect(q);
+	spin_unlock(&q->lock);
+	
+	smp_mb();
+	if (waitqueue_active(&q->map->wait))
+		wake_up_interruptible(&q->map->wait);
+}
+
+/* Whether collecting can make room in the stages: not when the shared 
+ * ring is full and its timestamps may not be evicted. Lockless, so only 
+ * a hint.
+ */
+static int nl_ts_queue_may_collect(struct nl_ts_queue *q)
+{
+	return READ_ONCE(q->policy) == NL_TS_POLICY_DROP_OLDEST || 
+		READ_ONCE(q->hdr->head) - READ_ONCE(q->hdr->tail) < 
+		READ_ONCE(q->capacity);
 }
 
-int nl_ts_queue_enqueue(struct nl_ts_queue *q, 
-	struct nl_ts_queue_element *qe)
+/* Stages n timestamps on this CPU, called with IRQs disabled. A full 
+ * stage is collected only if the lock is free, it is then kept for the 
+ * rest of the burst. Otherwise somebody else is collecting, which 
+ * drains this stage as well, or the ring is full: producers never wait 
+ * for each other, the timestamps not finding room are dropped. All of 
+ * them share one enq_ns. Returns the number staged, *evicted is raised 
+ * by the older timestamps evicted to make room.
+ */
+static unsigned int nl_ts_queue_stage_burst(struct nl_ts_queue *q, 
+	struct nl_ts *ts, unsigned int n, u32 *evicted)
+{
+	struct nl_ts_queue_stage *st = this_cpu_ptr(q->stage);
+	struct nl_ts_queue_element *qe;
+	unsigned int staged = 0;
+	unsigned int i;
+	int locked = 0;
+	u64 now = ktime_get_ns();
+	
+	for (i = 0; i < n; i++) {
+		if (st->head - smp_load_acquire(&st->tail) == NL_TS_STAGE_SIZE) {
+			if (!locked && nl_ts_queue_may_collect(q))
+				locked = spin_trylock(&q->lock);
+			if (locked)
+				*evicted += nl_ts_queue_collect(q);
+		}
+		
+		/* The rest of the burst goes too, what was queued is a 
+		 * prefix of ts.
+		 */
+		if (st->head - smp_load_acquire(&st->tail) == NL_TS_STAGE_SIZE) {
+			__this_cpu_add(q->counters->dropped, n - i);
+			break;
+		}
+		
+		qe = &st->slots[st->head & (NL_TS_STAGE_SIZE - 1)];
+		qe->ts = ts[i];
+		qe->enq_ns = now;
+		/* Publish the slot before the new head */
+		smp_store_release(&st->head, st->head + 1);
+		staged++;
+	}
+	
+	if (locked)
+		spin_unlock(&q->lock);
+	
+	__this_cpu_add(q->counters->enqueued, staged);
+	return staged;
+}
+
+/* Safe from any context, including hard IRQs, and from any number of 
+ * CPUs at once. Returns 0, NL_TS_QUEUE_OVERWROTE or -ENOSPC when the 
+ * timestamp was dropped.
+ */
+int nl_ts_queue_enqueue(struct nl_ts_queue *q, struct nl_ts *ts)
 {	
 	unsigned long flags;
+	unsigned int staged;
+	u32 evicted = 0;
+	
+	local_irq_save(flags);
+	staged = nl_ts_queue_stage_burst(q, ts, 1, &evicted);
+	local_irq_restore(flags);
+	
+	if (!staged)
+		return -ENOSPC;
+	
+	if (atomic_read(&q->map->attached))
+		irq_work_queue(&q->flush_work);
+	
+	return evicted ? NL_TS_QUEUE_OVERWROTE : 0;
+}
+
+/* As nl_ts_queue_enqueue() for the n timestamps of ts, with IRQs 
+ * disabled once. Returns how many were queued, from the first one, the 
+ * others were dropped.
+ */
+unsigned int nl_ts_queue_enqueue_bulk(struct nl_ts_queue *q, 
+	struct nl_ts *ts, unsigned int n)
+{
+	unsigned long flags;
+	unsigned int staged;
+	u32 evicted = 0;
+	
+	local_irq_save(flags);
+	staged = nl_ts_queue_stage_burst(q, ts, n, &evicted);
+	local_irq_restore(flags);
+	
+	if (staged && atomic_read(&q->map->attached))
+		irq_work_queue(&q->flush_work);
+	
+	return staged;
+}
+
+int nl_ts_queue_is_empty(struct nl_ts_queue *q)
+{
+	int cpu;
+	
+	if (READ_ONCE(q->hdr->head) != READ_ONCE(q->hdr->tail))
+		return 0;
+	
+	for_each_possible_cpu(cpu) {
+		if (!nl_ts_queue_stage_empty(per_cpu_ptr(q->stage, cpu)))
+			return 0;
+	}
+	
+	return 1;
+}
+
+static void nl_ts_queue_record_latency(struct nl_ts_queue *q, u64 enq_ns, 
+	u64 now)
+{
+	int b = 0;
+	
+	if (now > enq_ns)
+		b = min(fls64(now - enq_ns), NL_TS_HIST_BUCKETS - 1);
+	
+	this_cpu_inc(q->counters->latency[b]);
+}
+
+/* Runs under lock, unlike the producers: nl_ts_queue_take() removes 
+ * slots ahead of tail and the collector cannot evict meanwhile. Staged 
+ * timestamps are merged first, so none waits behind newer ones already 
+ * in the ring. Returns the number dequeued into ts, at most n, 0 when 
+ * the queue is empty or -EBUSY while a mapping is attached.
+ */
+int nl_ts_queue_dequeue_bulk(struct nl_ts_queue *q, struct nl_ts *ts, 
+	unsigned int n)
+{
+	struct nl_ts_ring_hdr *hdr = q->hdr;
+	struct nl_ts_queue_element *qe;
+	unsigned long flags;
+	unsigned int count = 0;
+	u64 now;
+	u32 tail;
 	
 	spin_lock_irqsave(&q->lock, flags);
-	list_add_tail(&qe->next, &q->queue);
+	
+	/* A mapped consumer owns the tail, attaching waits for the lock */
+	if (atomic_read(&q->map->attached)) {
+		spin_unlock_irqrestore(&q->lock, flags);
+		return -EBUSY;
+	}
+	
+	nl_ts_queue_collect(q);
+	
+	now = ktime_get_ns();
+	tail = hdr->tail;
+	while (count < n && tail != hdr->head) {
+		qe = &q->ring[tail & q->mask];
+		if (!test_bit(tail & q->mask, q->taken)) {
+			ts[count++] = qe->ts;
+			nl_ts_queue_record_latency(q, qe->enq_ns, now);
+		}
+		tail++;
+	}
+	
+	/* Release the slots only once they have been read */
+	smp_store_release(&hdr->tail, tail);
 	spin_unlock_irqrestore(&q->lock, flags);
 	
-	return 0;
+	this_cpu_add(q->counters->dequeued, count);
+	
+	return count;
 }
 
-int nl_ts_queue_is_empty(struct nl_ts_queue *q)
+int nl_ts_queue_dequeue(struct nl_ts_queue *q, struct nl_ts *ts)
+{
+	int rc = nl_ts_queue_dequeue_bulk(q, ts, 1);
+	
+	if (rc < 0)
+		return rc;
+	
+	return rc ? 0 : -ENOENT;
+}
+
+static int nl_ts_queue_match(struct nl_ts_queue *q, u32 pos, 
+	u16 id, u64 seq)
 {
-	return list_empty(&q->queue);
+	struct nl_ts *ts = &q->ring[pos & q->mask].ts;
+	
+	return !test_bit(pos & q->mask, q->taken) && 
+		ts->id == id && ts->seq == seq;
 }
 
-struct nl_ts_queue_element *nl_ts_queue_dequeue(struct nl_ts_queue *q)
+/* Remove the timestamp matching id and seq wherever it sits in the 
+ * ring, staged ones are merged first. The index gives its position 
+ * unless a newer timestamp took the bucket over, then only the part 
+ * of the ring older than that one is scanned.
+ */
+int nl_ts_queue_take(struct nl_ts_queue *q, u16 id, u64 seq, 
+	struct nl_ts *ts)
 {
-	struct nl_ts_queue_element *qe = NULL;
+	struct nl_ts_ring_hdr *hdr = q->hdr;
 	unsigned long flags;
+	u64 enq_ns = 0;
+	u32 tail, head;
+	u32 pos, p;
+	int rc = -ENOENT;
 	
 	spin_lock_irqsave(&q->lock, flags);
-	if (!nl_ts_queue_is_empty(q)) {
-		qe = list_first_entry(&q->queue, struct nl_ts_queue_element,
-			next);
-		list_del(&qe->next);
+	if (atomic_read(&q->map->attached)) {
+		rc = -EBUSY;
+		goto out;
+	}
+	
+	nl_ts_queue_collect(q);
+	
+	tail = hdr->tail;
+	head = hdr->head;
+	pos = q->index[nl_ts_queue_hash(q, id, seq)];
+	
+	/* Positions only grow: once the bucket is out of the ring, every 
+	 * older timestamp with the same key is gone as well.
+	 */
+	if (pos - tail >= head - tail)
+		goto out;
+	
+	if (!nl_ts_queue_match(q, pos, id, seq)) {
+		for (p = tail; p != pos; p++) {
+			if (nl_ts_queue_match(q, p, id, seq))
+				break;
+		}
+		if (p == pos)
+			goto out;
+		pos = p;
+	}
+	
+	__set_bit(pos & q->mask, q->taken);
+	*ts = q->ring[pos & q->mask].ts;
+	enq_ns = q->ring[pos & q->mask].enq_ns;
+	rc = 0;
+	
+	/* Do not leave taken slots at tail, is_empty() looks at it */
+	while (tail != head && test_bit(tail & q->mask, q->taken))
+		tail++;
+	smp_store_release(&hdr->tail, tail);
+
+out:
+	spin_unlock_irqrestore(&q->lock, flags);
+	
+	if (rc == 0) {
+		this_cpu_inc(q->counters->dequeued);
+		nl_ts_queue_record_latency(q, enq_ns, ktime_get_ns());
+	}
+	
+	return rc;
+}
+
+/* capacity is clamped to 1..the ring size. Shrinking a 
+ * NL_TS_POLICY_DROP_OLDEST queue below its depth evicts the excess 
+ * right away, a NL_TS_POLICY_DROP_NEWEST one just takes nothing in 
+ * until it has been drained below capacity.
+ */
+int nl_ts_queue_set_limits(struct nl_ts_queue *q, u32 capacity, int policy)
+{
+	struct nl_ts_ring_hdr *hdr = q->hdr;
+	unsigned long flags;
+	u32 tail;
+	
+	if (policy < 0 || policy > NL_TS_POLICY_MAX)
+		return -EINVAL;
+	
+	spin_lock_irqsave(&q->lock, flags);
+	q->capacity = clamp_t(u32, capacity, 1, q->mask + 1);
+	q->policy = policy;
+	
+	if (policy == NL_TS_POLICY_DROP_OLDEST) {
+		tail = smp_load_acquire(&hdr->tail);
+		while (hdr->head - tail > q->capacity && 
+			hdr->head - tail <= q->mask + 1) {
+			nl_ts_queue_evict(q, tail);
+			tail = smp_load_acquire(&hdr->tail);
+		}
 	}
 	spin_unlock_irqrestore(&q->lock, flags);
 	
-	return qe;
+	return 0;
+}
+
+/* Timestamps lost so far: rejected by producers plus evicted ones */
+u64 nl_ts_queue_dropped(struct nl_ts_queue *q)
+{
+	u64 dropped = 0;
+	int cpu;
+	
+	for_each_possible_cpu(cpu)
+		dropped += READ_ONCE(per_cpu_ptr(q->counters, cpu)->dropped);
+	
+	return dropped;
+}
+
+/* Lockless, the counters of other CPUs may be slightly behind */
+void nl_ts_queue_get_stats(struct nl_ts_queue *q, 
+	struct nl_ts_queue_stats *stats)
+{
+	struct nl_ts_queue_counters *c;
+	struct nl_ts_queue_stage *st;
+	u32 depth;
+	int cpu;
+	
+	memset(stats, 0, sizeof(*stats));
+	
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(q->counters, cpu);
+		stats->enqueued += READ_ONCE(c->enqueued);
+		stats->dequeued += READ_ONCE(c->dequeued);
+		stats->dropped += READ_ONCE(c->dropped);
+		stats->empty_polls += READ_ONCE(c->empty_polls);
+		
+		st = per_cpu_ptr(q->stage, cpu);
+		stats->depth += READ_ONCE(st->head) - READ_ONCE(st->tail);
+	}
+	
+	depth = READ_ONCE(q->hdr->head) - READ_ONCE(q->hdr->tail);
+	if (depth <= q->mask + 1)
+		stats->depth += depth;
+	
+	stats->high_watermark = READ_ONCE(q->high_watermark);
+	stats->capacity = READ_ONCE(q->capacity);
+	stats->policy = READ_ONCE(q->policy);
+}
+
+/* buckets must hold NL_TS_HIST_BUCKETS counters */
+void nl_ts_queue_get_hist(struct nl_ts_queue *q, u64 *buckets)
+{
+	struct nl_ts_queue_counters *c;
+	int cpu;
+	int i;
+	
+	memset(buckets, 0, NL_TS_HIST_BUCKETS * sizeof(*buckets));
+	
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(q->counters, cpu);
+		for (i = 0; i < NL_TS_HIST_BUCKETS; i++)
+			buckets[i] += READ_ONCE(c->latency[i]);
+	}
 }
 
+/* A dequeue running meanwhile on another CPU may survive the reset */
+void nl_ts_queue_reset_hist(struct nl_ts_queue *q)
+{
+	struct nl_ts_queue_counters *c;
+	int cpu;
+	int i;
+	
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(q->counters, cpu);
+		for (i = 0; i < NL_TS_HIST_BUCKETS; i++)
+			WRITE_ONCE(c->latency[i], 0);
+	}
+}
+
+/* Called once no producer can reach q any more */
 void nl_ts_queue_kfree(struct nl_ts_queue *q)
 {
-	struct nl_ts_queue_element *qe = NULL;
+	struct nl_ts_queue_map *map = q->map;
+	
+	if(!map)
+		return;
+	
+	irq_work_sync(&q->flush_work);
+	free_percpu(q->stage);
+	free_percpu(q->counters);
+	kfree(q->pending);
+	kfree(q->index);
+	kfree(q->taken);
+	atomic_long_sub(nl_ts_queue_percpu_bytes() + 
+		nl_ts_queue_index_bytes(q->mask + 1), &nl_ts_queue_mem);
+	
+	q->map = NULL;
+	q->hdr = NULL;
+	q->ring = NULL;
+	q->stage = NULL;
+	q->counters = NULL;
+	q->pending = NULL;
+	q->index = NULL;
+	q->taken = NULL;
 	
-	while (!nl_ts_queue_is_empty(q)) {
-		qe = list_first_entry(&q->queue, struct nl_ts_queue_element,
-			next);
-		list_del(&qe->next);
-		kfree(qe);
+	/* Wake a mapped consumer so poll() reports the hang up */
+	map->dead = 1;
+	wake_up_interruptible(&map->wait);
+	kref_put(&map->ref, nl_ts_queue_map_release);
+}
+
+/* Close the gaps nl_ts_queue_take() left in the ring before a mapped 
+ * consumer, which knows nothing of taken, would read those slots 
+ * again: the older timestamps move up next to the newer ones, tail 
+ * follows and the index is rebuilt, newest last. Called with q->lock 
+ * held, only while no mapping is attached.
+ */
+static void nl_ts_queue_compact(struct nl_ts_queue *q)
+{
+	struct nl_ts_ring_hdr *hdr = q->hdr;
+	struct nl_ts *ts;
+	u32 tail = hdr->tail;
+	u32 head = hdr->head;
+	u32 dst = head;
+	u32 src = head;
+	u32 p;
+	
+	if (head - tail > q->mask + 1)
+		return;
+	
+	while (src != tail) {
+		src--;
+		if (test_bit(src & q->mask, q->taken))
+			continue;
+		dst--;
+		if (dst != src)
+			q->ring[dst & q->mask] = q->ring[src & q->mask];
+	}
+	
+	if (dst == tail)
+		return;
+	
+	for (p = tail; p != head; p++)
+		__clear_bit(p & q->mask, q->taken);
+	
+	for (p = dst; p != head; p++) {
+		ts = &q->ring[p & q->mask].ts;
+		q->index[nl_ts_queue_hash(q, ts->id, ts->seq)] = p;
+	}
+	
+	smp_store_release(&hdr->tail, dst);
+}
+
+/* Make the caller the only consumer of q, through a mapping of its 
+ * storage. Returns NULL if another mapping is already attached. Under 
+ * lock, so that a kernel consumer still moving tail with plain stores 
+ * is done before userspace starts moving it too.
+ */
+struct nl_ts_queue_map *nl_ts_queue_map_attach(struct nl_ts_queue *q)
+{
+	struct nl_ts_queue_map *map = q->map;
+	unsigned long flags;
+	
+	if (!map)
+		return NULL;
+	
+	spin_lock_irqsave(&q->lock, flags);
+	if (atomic_read(&map->attached) != 0) {
+		map = NULL;
+	} else {
+		nl_ts_queue_compact(q);
+		atomic_set(&map->attached, 1);
+		kref_get(&map->ref);
 	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	
+	return map;
+}
+
+void nl_ts_queue_map_detach(struct nl_ts_queue_map *map)
+{
+	atomic_set(&map->attached, 0);
+	kref_put(&map->ref, nl_ts_queue_map_release);
 }
 
 static void nl_ts_queue_element_printk(struct nl_ts_queue_element *qe)
@@ -85,16 +738,14 @@ static void nl_ts_queue_element_printk(struct nl_ts_queue_element *qe)
 	printk("ahead: %d \n", qe->ts.ahead);
 	printk("valid: %d \n", qe->ts.valid);
 	printk("type: %d \n", qe->ts.type);
+	printk("enq_ns: %llu \n", qe->enq_ns);
 	printk("\n");
 }
 
 void nl_ts_queue_printk(struct nl_ts_queue *q)
 {	
-	struct list_head *i;
+	u32 i;
 	
-	list_for_each(i, &q->queue) {
-		struct nl_ts_queue_element *qe = list_entry(i, 
-			struct nl_ts_queue_element, next);
-		nl_ts_queue_element_printk(qe);
-	}
+	for (i = READ_ONCE(q->hdr->tail); i != READ_ONCE(q->hdr->head); i++)
+		nl_ts_queue_element_printk(&q->ring[i & q->mask]);
 }
@@ -7,18 +7,73 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/cache.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/irq_work.h>
 #endif
+#include <linux/ioctl.h>
 
 #define IFNAME_SIZE 10
-#define VERSION_NR 1
+#define VERSION_NR 2
+
+/* Clients sending at least this version in their genetlink header get 
+ * their timestamps as NL_TS_A_TS_PACKED instead of NL_TS_A_TS_NESTED. 
+ * Multicast NL_TS_C_TS_EVENT messages stay nested.
+ */
+#define NL_TS_VERSION_PACKED 2
 
 enum {
 	NL_TS_A_UNSPEC,
 	NL_TS_A_TS_NESTED,
+	NL_TS_A_MORE,
+	NL_TS_A_IFACE,
+	NL_TS_A_DESC,
+	NL_TS_A_IFINDEX,
+	NL_TS_A_DROPPED,
+	NL_TS_A_STATS,
+	NL_TS_A_HIST,
+	NL_TS_A_TS_PACKED,
+	NL_TS_A_TS_DELTA,
 	__NL_TS_A_MAX,
 };
 #define NL_TS_A_MAX (__NL_TS_A_MAX - 1)
 
+/* Counters of one queue, nested in NL_TS_A_STATS */
+enum {
+	NL_TS_A_STATS_UNSPEC,
+	NL_TS_A_STATS_TYPE,
+	NL_TS_A_STATS_ENQUEUED,
+	NL_TS_A_STATS_DEQUEUED,
+	NL_TS_A_STATS_DROPPED,
+	NL_TS_A_STATS_EMPTY_POLLS,
+	NL_TS_A_STATS_DEPTH,
+	NL_TS_A_STATS_HIGH_WATERMARK,
+	NL_TS_A_STATS_CAPACITY,
+	NL_TS_A_STATS_POLICY,
+	__NL_TS_A_STATS_MAX,
+};
+#define NL_TS_A_STATS_MAX (__NL_TS_A_STATS_MAX - 1)
+
+/* Latency histogram of one queue, nested in NL_TS_A_HIST. Inside 
+ * NL_TS_A_HIST_BUCKETS, attribute i + 1 is the u64 count of bucket i, 
+ * empty buckets are left out.
+ */
+enum {
+	NL_TS_A_HIST_UNSPEC,
+	NL_TS_A_HIST_TYPE,
+	NL_TS_A_HIST_BUCKETS,
+	__NL_TS_A_HIST_MAX,
+};
+#define NL_TS_A_HIST_MAX (__NL_TS_A_HIST_MAX - 1)
+
+/* Enqueue to dequeue delays, in log2 buckets: bucket 0 counts 0 ns, 
+ * bucket i [2^(i-1), 2^i) ns and the last one everything above.
+ */
+#define NL_TS_HIST_BUCKETS 40
+
 enum {
 	NL_TS_A_TS_NESTED_UNSPEC,
 	NL_TS_A_TS_NESTED_TYPE,
@@ -49,6 +104,40 @@ struct nl_ts {
 		int valid;
 };
 
+/* Fixed layout of one record in NL_TS_A_TS_PACKED, which holds an 
+ * array of them: all of a batch, or one. 32 bytes without padding, in 
+ * host order; the attribute payload is only 4 byte aligned so copy the 
+ * records out before use. type and valid are narrowed to 8 bits.
+ */
+struct nl_ts_packed {
+#ifdef __KERNEL__
+	u64 sec;
+	u64 nsec;
+	u64 seq;
+	s32 ahead;
+	u16 id;
+	u8 type;
+	u8 valid;
+#else
+	uint64_t sec;
+	uint64_t nsec;
+	uint64_t seq;
+	int32_t ahead;
+	uint16_t id;
+	uint8_t type;
+	uint8_t valid;
+#endif
+};
+
+/* NL_TS_A_CMD_NESTED_ENCODING of a NL_TS_C_GETTS_BATCH request. With 
+ * NL_TS_ENC_DELTA the records come in one NL_TS_A_TS_DELTA stream, see 
+ * nl_ts_codec.h.
+ */
+enum {
+	NL_TS_ENC_DEFAULT,
+	NL_TS_ENC_DELTA,
+};
+
 #define MYNL_CMD_GETTS_TX 0
 #define MYNL_CMD_GETTS_RX 1
 
@@ -61,6 +150,21 @@ enum {
 	NL_TS_A_CMD_NESTED_UNSPEC,
 	NL_TS_A_CMD_NESTED_CMD,
 	NL_TS_A_CMD_NESTED_IFACE,
+	NL_TS_A_CMD_NESTED_MAX_COUNT,
+	NL_TS_A_CMD_NESTED_DESC,
+	NL_TS_A_CMD_NESTED_IFINDEX,
+	NL_TS_A_CMD_NESTED_CAPACITY,
+	NL_TS_A_CMD_NESTED_POLICY,
+	NL_TS_A_CMD_NESTED_ID,
+	NL_TS_A_CMD_NESTED_SEQ,
+	NL_TS_A_CMD_NESTED_ENCODING,
+	NL_TS_A_CMD_NESTED_TIMEOUT,
+	NL_TS_A_CMD_NESTED_FRAMES,
+	NL_TS_A_CMD_NESTED_USECS,
+	NL_TS_A_CMD_NESTED_TYPES,
+	NL_TS_A_CMD_NESTED_ID_MIN,
+	NL_TS_A_CMD_NESTED_ID_MAX,
+	NL_TS_A_CMD_NESTED_VALID,
 	__NL_TS_A_CMD_NESTED_MAX,
 };
 #define NL_TS_A_CMD_NESTED_MAX (__NL_TS_A_CMD_NESTED_MAX - 1)
@@ -68,34 +172,297 @@ enum {
 enum {
 	NL_TS_C_UNSPEC,
 	NL_TS_C_GETTS,
+	NL_TS_C_GETTS_BATCH,
+	NL_TS_C_TS_EVENT,
+	NL_TS_C_RESOLVE,
+	NL_TS_C_SET_QUEUE,
+	NL_TS_C_GET_STATS,
+	NL_TS_C_GET_HIST,
+	NL_TS_C_RESET_HIST,
+	NL_TS_C_GETTS_ID,
+	NL_TS_C_SET_COALESCE,
+	NL_TS_C_SUBSCRIBE,
+	NL_TS_C_UNSUBSCRIBE,
 	__NL_TS_C_MAX,
 };
 #define NL_TS_C_MAX (__NL_TS_C_MAX - 1)
 
+/* Multicast groups: every timestamp queued on an interface is pushed 
+ * to the group of its type as a NL_TS_C_TS_EVENT message, from a 
+ * tasklet rather than by the producer. Dropped ones are only counted, 
+ * and up to 4 * NL_TS_MAX_COALESCE_FRAMES timestamps per queue wait 
+ * for the tasklet, the ones beyond are not pushed.
+ */
+#define NL_TS_MCGRP_TX_NAME "ts_tx"
+#define NL_TS_MCGRP_RX_NAME "ts_rx"
+
+/* NL_TS_C_SET_COALESCE moderates the pushes of the queue selected by 
+ * NL_TS_A_CMD_NESTED_CMD, like NIC interrupts: timestamps are held back 
+ * until NL_TS_A_CMD_NESTED_FRAMES of them are pending, or 
+ * NL_TS_A_CMD_NESTED_USECS passed since the first one, whichever comes 
+ * first, then pushed as one message. 1 frame (the default) pushes every 
+ * timestamp right away, together with the ones added before the push 
+ * ran, 0 usecs only pushes full messages. Missing 
+ * attributes keep their current value. Needs CAP_NET_ADMIN.
+ */
+#define NL_TS_MAX_COALESCE_FRAMES 32
+#define NL_TS_MAX_COALESCE_USECS 1000000
+
+/* NL_TS_C_SUBSCRIBE has the timestamps matching a filter unicast to the 
+ * sender, as NL_TS_C_TS_EVENT messages holding only those, without 
+ * joining a group: timestamps of the named interface (of any without 
+ * one), of the types in NL_TS_A_CMD_NESTED_TYPES (a mask of 
+ * 1 << MYNL_CMD_*_OK_RESP, both without), with an id from 
+ * NL_TS_A_CMD_NESTED_ID_MIN to _ID_MAX, and only valid ones with a non 
+ * zero NL_TS_A_CMD_NESTED_VALID. One subscription per interface and 
+ * socket, subscribing again replaces it; a timestamp is sent once per 
+ * subscription it matches. NL_TS_C_UNSUBSCRIBE drops the subscription 
+ * of the named interface, or all of them. They are dropped as well 
+ * when the socket is closed or the interface unregistered. Every 
+ * subscription costs an event allocation per push, subscribing needs 
+ * CAP_NET_ADMIN.
+ */
+#define NL_TS_MAX_SUBS 256	/* of all sockets */
+
+/* NL_TS_C_RESOLVE maps NL_TS_A_CMD_NESTED_IFACE to NL_TS_A_DESC (and 
+ * NL_TS_A_IFINDEX for a real net device). Later requests can then name 
+ * the interface with NL_TS_A_CMD_NESTED_DESC or _IFINDEX instead.
+ */
+
+/* NL_TS_C_SET_QUEUE changes the capacity (NL_TS_A_CMD_NESTED_CAPACITY) 
+ * and/or overflow policy (NL_TS_A_CMD_NESTED_POLICY) of the queue 
+ * selected by NL_TS_A_CMD_NESTED_CMD, needs CAP_NET_ADMIN. 
+ * NL_TS_C_GETTS_BATCH replies carry the drop count of the queue in 
+ * NL_TS_A_DROPPED.
+ * NL_TS_C_GET_STATS answers with NL_TS_A_IFACE, NL_TS_A_DESC and one 
+ * NL_TS_A_STATS per queue, for the interface named in the request or, 
+ * as a dump, for every registered interface. NL_TS_C_GET_HIST does the 
+ * same with one NL_TS_A_HIST per queue, NL_TS_C_RESET_HIST clears the 
+ * histograms of the NL_TS_A_CMD_NESTED_CMD queue, or of both without 
+ * it, and needs CAP_NET_ADMIN. Only the kernel consumer is measured.
+ * NL_TS_C_GETTS_ID answers like NL_TS_C_GETTS, with the timestamp 
+ * matching NL_TS_A_CMD_NESTED_ID and _SEQ, taken out of the queue 
+ * wherever it sits (the tx one unless NL_TS_A_CMD_NESTED_CMD says rx), 
+ * or MYNL_CMD_QEMPTY_RESP if there is none.
+ * A NL_TS_C_GETTS_BATCH request with NL_TS_A_CMD_NESTED_TIMEOUT (in ms, 
+ * at most NL_TS_MAX_TIMEOUT_MS) finding its queue empty is parked until 
+ * a timestamp is added to the queue, then answered with a batch, or 
+ * until the timeout, then answered with MYNL_CMD_QEMPTY_RESP. Its reply 
+ * may come after later requests' ones, so it should be sent without 
+ * NLM_F_ACK and be considered done when its reply comes.
+ */
+#define NL_TS_MAX_TIMEOUT_MS 60000
+
+/* What a full queue does with a new timestamp */
+enum {
+	NL_TS_POLICY_DROP_NEWEST,	/* reject it */
+	NL_TS_POLICY_DROP_OLDEST,	/* evict the oldest queued one */
+	__NL_TS_POLICY_MAX,
+};
+#define NL_TS_POLICY_MAX (__NL_TS_POLICY_MAX - 1)
+
 struct nl_ts_cmd {
 	int cmd;
 	char iface[IFNAME_SIZE];
+	unsigned int max_count;
+	int encoding;
+	unsigned int timeout;	/* ms */
 };
 
-#ifdef __KERNEL__
+/* Default capacity of a queue. Rings are sized at registration, to the 
+ * capacity rounded up to a power of two, up to NL_TS_QUEUE_MAX_SIZE 
+ * slots; NL_TS_C_SET_QUEUE can only change it within the ring.
+ */
+#define NL_TS_QUEUE_SIZE 1024
+#define NL_TS_QUEUE_MAX_SIZE 65536
+
+/* enq_ns is the CLOCK_MONOTONIC time the timestamp was enqueued at */
 struct nl_ts_queue_element {
-		struct list_head next;
 		struct nl_ts ts;
+#ifdef __KERNEL__
+		u64 enq_ns;
+#else
+		uint64_t enq_ns;
+#endif
+};
+
+/* Shared ring layout. A queue lives in one page aligned area: this 
+ * header in the first page, then the slots at data_offset. Both the 
+ * kernel and a consumer that mmap()s the area through NL_TS_DEV_NAME 
+ * use it as is. head is only written by the producer, both run freely 
+ * and are masked with size - 1. A mapped consumer reads head with 
+ * acquire semantics, copies the slot at tail and then moves tail 
+ * forward with a compare-and-swap: under NL_TS_POLICY_DROP_OLDEST the 
+ * producer evicts from a full ring by advancing tail itself, so a 
+ * failed swap means the copy may be torn and must be discarded.
+ */
+#define NL_TS_RING_MAGIC 0x6e6c7473
+#define NL_TS_RING_VERSION 3
+
+struct nl_ts_ring_hdr {
+#ifdef __KERNEL__
+	u32 magic;
+	u32 version;
+	u32 size;
+	u32 slot_size;
+	u32 data_offset;
+	u32 head ____cacheline_aligned_in_smp;
+	u32 tail ____cacheline_aligned_in_smp;
+#else
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t slot_size;
+	uint32_t data_offset;
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+#endif
 };
 
+/* Character device exporting the rings. NL_TS_IOC_ATTACH binds an open 
+ * file to one queue of one interface, which then becomes its only 
+ * consumer until the file is closed: mmap() maps the whole area and 
+ * poll() reports POLLIN while the ring is not empty.
+ */
+#define NL_TS_DEV_NAME "nl_ts"
+
+struct nl_ts_attach {
+	char iface[IFNAME_SIZE];
+	int type;
+};
+
+#define NL_TS_IOC_MAGIC 'T'
+#define NL_TS_IOC_ATTACH _IOW(NL_TS_IOC_MAGIC, 1, struct nl_ts_attach)
+
+#ifdef __KERNEL__
+/* Storage of one queue. It is refcounted because a mapping may 
+ * outlive the interface it was attached to.
+ */
+struct nl_ts_queue_map {
+	struct kref ref;
+	struct nl_ts_ring_hdr *hdr;
+	size_t size;
+	atomic_t attached;	/* set under the queue lock */
+	int dead;
+	wait_queue_head_t wait;
+};
+
+/* Slots of a per-CPU staging ring, must be a power of two */
+#define NL_TS_STAGE_SIZE 16
+
+/* Written by one CPU with IRQs disabled (head) and drained by the 
+ * collector under the queue lock (tail). tail has a line of its own so 
+ * that collecting does not steal the producer's line.
+ */
+struct nl_ts_queue_stage {
+	u32 head;
+	struct nl_ts_queue_element slots[NL_TS_STAGE_SIZE];
+	u32 tail ____cacheline_aligned_in_smp;
+};
+
+/* Event counters, one copy per CPU so that nobody shares a cache line 
+ * to count. dequeued only covers the kernel consumer, a mapped one 
+ * consumes enqueued - dropped - depth.
+ */
+struct nl_ts_queue_counters {
+	u64 enqueued;
+	u64 dequeued;
+	u64 dropped;
+	u64 empty_polls;
+	u64 latency[NL_TS_HIST_BUCKETS];
+};
+
+/* Snapshot returned by nl_ts_queue_get_stats() */
+struct nl_ts_queue_stats {
+	u64 enqueued;
+	u64 dequeued;
+	u64 dropped;
+	u64 empty_polls;
+	u32 depth;
+	u32 high_watermark;
+	u32 capacity;
+	int policy;
+};
+
+/* Buckets of the (id, seq) index per ring slot, must be a power of two */
+#define NL_TS_INDEX_PER_SLOT 4
+
+/* Fixed-size ring of timestamps, allocated once by nl_ts_queue_init().
+ * Producers never wait for a lock: each one stages into the ring of its 
+ * own CPU. Staged timestamps are merged into the shared ring under 
+ * lock, the ones staged at the time in seq order: by the kernel 
+ * consumer before every dequeue call, by a producer whose stage is 
+ * full if it gets the lock at once and the ring has room, or by 
+ * flush_work while a mapping is attached. A timestamp staged after a 
+ * merge comes after the ones it merged, whatever its seq. Callers 
+ * serialize their consumers; while a mapping is attached the kernel 
+ * consumer side is disabled.
+ * capacity and policy are only used by the collector, under lock, 
+ * producers just peek at them: at most capacity timestamps sit in the 
+ * shared ring, plus up to NL_TS_STAGE_SIZE per CPU in the stages.
+ * index maps a hash of (id, seq) to the ring position of the newest 
+ * timestamp merged with it, and taken marks the slots removed out of 
+ * order by nl_ts_queue_take(). Both are only used under lock; taken 
+ * slots are compacted out of the ring before a mapping is attached.
+ * Producers only read the first line, which never changes after init. 
+ * The collector side and flush_work, written while a mapping is 
+ * attached, each get their own lines.
+ */
 struct nl_ts_queue {
-	struct list_head queue;
-	spinlock_t lock;
+	struct nl_ts_queue_map *map;
+	struct nl_ts_queue_stage __percpu *stage;
+	struct nl_ts_queue_counters __percpu *counters;
+	
+	spinlock_t lock ____cacheline_aligned_in_smp;
+	struct nl_ts_ring_hdr *hdr;
+	struct nl_ts_queue_element *ring;
+	u32 mask;
+	struct nl_ts_queue_stage **pending;
+	u32 *index;
+	u32 index_mask;
+	unsigned long *taken;
+	u32 capacity;
+	int policy;
+	u32 high_watermark;
+	
+	struct irq_work flush_work ____cacheline_aligned_in_smp;
 };
 
-struct nl_ts_queue_element * nl_ts_queue_kmalloc(struct nl_ts *ts);
-void nl_ts_queue_init(struct nl_ts_queue *q);
-int nl_ts_queue_enqueue(struct nl_ts_queue *q, 
-	struct nl_ts_queue_element *qe);
-struct nl_ts_queue_element *nl_ts_queue_dequeue(struct nl_ts_queue *q);
+/* nl_ts_queue_enqueue() result: queued, but older timestamps had to be 
+ * evicted to make room. A full NL_TS_POLICY_DROP_NEWEST queue returns 
+ * -ENOSPC instead.
+ */
+#define NL_TS_QUEUE_OVERWROTE 1
+
+long nl_ts_queue_mem_usage(void);
+
+int nl_ts_queue_init(struct nl_ts_queue *q, u32 capacity);
+int nl_ts_queue_enqueue(struct nl_ts_queue *q, struct nl_ts *ts);
+unsigned int nl_ts_queue_enqueue_bulk(struct nl_ts_queue *q, 
+	struct nl_ts *ts, unsigned int n);
+int nl_ts_queue_dequeue(struct nl_ts_queue *q, struct nl_ts *ts);
+int nl_ts_queue_dequeue_bulk(struct nl_ts_queue *q, struct nl_ts *ts, 
+	unsigned int n);
+int nl_ts_queue_take(struct nl_ts_queue *q, u16 id, u64 seq, 
+	struct nl_ts *ts);
 int nl_ts_queue_is_empty(struct nl_ts_queue *q);
+int nl_ts_queue_set_limits(struct nl_ts_queue *q, u32 capacity, int policy);
+u64 nl_ts_queue_dropped(struct nl_ts_queue *q);
+void nl_ts_queue_get_stats(struct nl_ts_queue *q, 
+	struct nl_ts_queue_stats *stats);
+void nl_ts_queue_get_hist(struct nl_ts_queue *q, u64 *buckets);
+void nl_ts_queue_reset_hist(struct nl_ts_queue *q);
+
+/* For consumers answering a request with "queue empty" */
+static inline void nl_ts_queue_count_empty_poll(struct nl_ts_queue *q)
+{
+	this_cpu_inc(q->counters->empty_polls);
+}
 void nl_ts_queue_kfree(struct nl_ts_queue *q);
 void nl_ts_queue_printk(struct nl_ts_queue *q);
+
+struct nl_ts_queue_map *nl_ts_queue_map_attach(struct nl_ts_queue *q);
+void nl_ts_queue_map_detach(struct nl_ts_queue_map *map);
 #endif
 
 #endif /* __NL_TS_QUEUE__ */
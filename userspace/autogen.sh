@@ -9,8 +9,13 @@ cd ../lib/libnl
 cd ${cdir}
 echo -e "all:" > Makefile
 echo -e "\tmake -C ../lib/libnl" >> Makefile
-echo -e "\tgcc  -o userspace_netlink.run userspace_netlink.c -I../lib/libnl/include -I../kernel -L../lib/libnl/lib/.libs -l:libnl-3.a -l:libnl-genl-3.a -lpthread -lm" >> Makefile
+echo -e "\tgcc -c -o libnlts.o libnlts.c -I../lib/libnl/include -I../kernel" >> Makefile
+echo -e "\tar rcs libnlts.a libnlts.o" >> Makefile
+echo -e "\tgcc  -o userspace_netlink.run userspace_netlink.c -I../lib/libnl/include -I../kernel -L. -l:libnlts.a -L../lib/libnl/lib/.libs -l:libnl-3.a -l:libnl-genl-3.a -lpthread -lm" >> Makefile
+echo -e "\tgcc  -o nl_ts_daemon.run nl_ts_daemon.c -I../lib/libnl/include -I../kernel -L. -l:libnlts.a -L../lib/libnl/lib/.libs -l:libnl-3.a -l:libnl-genl-3.a -lpthread -lm" >> Makefile
+echo -e "\tgcc  -o nl_ts_bench.run nl_ts_bench.c -I../lib/libnl/include -I../kernel -L. -l:libnlts.a -L../lib/libnl/lib/.libs -l:libnl-3.a -l:libnl-genl-3.a -lpthread -lm" >> Makefile
+echo -e "\tgcc -O2 -D__KERNEL__ -o nl_ts_qbench.run qbench/qbench.c qbench/unpadded.c qbench/shim/kshim.c ../kernel/nl_ts_queue.c -Iqbench/shim -I../kernel -lpthread" >> Makefile
 echo -e ""	>> Makefile
 echo -e "clean:" >> Makefile
 echo -e "\tmake -C ../lib/libnl clean" >> Makefile
-echo -e "\trm userspace_netlink.run" >> Makefile
+echo -e "\trm -f libnlts.o libnlts.a userspace_netlink.run nl_ts_daemon.run nl_ts_bench.run nl_ts_qbench.run" >> Makefile
@@ -0,0 +1,916 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include <netlink/socket.h>
+#include <netlink/msg.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+
+#include "libnlts.h"
+#include "nl_ts_codec.h"
+
+/* Replies of a full window of batch requests fit in the socket */
+#define NL_TS_RCVBUF_SIZE (1 << 20)
+
+/* Dump without the interface attributes */
+#define NL_TS_REQ_DUMP 0x100
+
+struct nl_ts_inflight {
+	uint32_t seq;
+	int cmd;
+	int busy;
+	int noack;	/* done with its reply */
+	int err;
+};
+
+struct nl_ts_socket {
+	struct nl_sock *nlsock;
+	int fd;
+	int family_id;
+	int grp[2];	/* tx and rx multicast groups, once resolved */
+	char ifname[IFNAME_SIZE];
+	int desc;
+	int version;	/* sent in requests, selects the reply format */
+	int encoding;	/* NL_TS_ENC_* asked for batches */
+	int nonblock;
+	struct nl_ts_handler handler;
+	void *arg;
+	struct nl_msg *msg;	/* scratch, rewound for every request */
+	unsigned int inflight;
+	uint64_t busy;	/* mask of the busy req[] */
+	size_t txlen;
+	struct nl_ts_inflight req[NL_TS_MAX_INFLIGHT];
+	unsigned char txbuf[NL_TS_TXBUF_SIZE];
+	unsigned char rxbuf[NL_TS_RXBUF_SIZE];
+};
+
+static struct nla_policy nested_policy[NL_TS_A_TS_NESTED_MAX + 1] =
+{
+	[NL_TS_A_TS_NESTED_SEC] = { .type = NLA_U64 },
+	[NL_TS_A_TS_NESTED_NSEC] = { .type = NLA_U64 },
+	[NL_TS_A_TS_NESTED_SEQ] = { .type = NLA_U64 },
+	[NL_TS_A_TS_NESTED_ID] = { .type = NLA_U16 },
+	[NL_TS_A_TS_NESTED_AHEAD] = { .type = NLA_U32 },
+	[NL_TS_A_TS_NESTED_VALID] = { .type = NLA_U32 },
+	[NL_TS_A_TS_NESTED_TYPE] = { .type = NLA_U32 },
+};
+
+static int nl_ts_parse_ts(struct nlattr *na, struct nl_ts *ts)
+{
+	struct nlattr *nested[NL_TS_A_TS_NESTED_MAX+1];
+	int err;
+	int i;
+
+	err = nla_parse_nested(nested,NL_TS_A_TS_NESTED_MAX,
+		na,nested_policy);
+	if(err != 0)
+		return err;
+
+	for(i = NL_TS_A_TS_NESTED_SEC ; i <= NL_TS_A_TS_NESTED_MAX ; i++) {
+		if(!nested[i])
+			return -EINVAL;
+	}
+
+	ts->sec = nla_get_u64(nested[NL_TS_A_TS_NESTED_SEC]);
+	ts->nsec = nla_get_u64(nested[NL_TS_A_TS_NESTED_NSEC]);
+	ts->seq = nla_get_u64(nested[NL_TS_A_TS_NESTED_SEQ]);
+	ts->valid = nla_get_u32(nested[NL_TS_A_TS_NESTED_VALID]);
+	ts->type = nla_get_u32(nested[NL_TS_A_TS_NESTED_TYPE]);
+	ts->ahead = nla_get_u32(nested[NL_TS_A_TS_NESTED_AHEAD]);
+	ts->id = nla_get_u16(nested[NL_TS_A_TS_NESTED_ID]);
+
+	return 0;
+}
+
+static void nl_ts_unpack_ts(const void *data, struct nl_ts *ts)
+{
+	struct nl_ts_packed p;
+
+	/* Records are only 4 byte aligned in the attribute */
+	memcpy(&p, data, sizeof(p));
+
+	ts->sec = p.sec;
+	ts->nsec = p.nsec;
+	ts->seq = p.seq;
+	ts->ahead = p.ahead;
+	ts->id = p.id;
+	ts->type = p.type;
+	ts->valid = p.valid;
+}
+
+static void nl_ts_deliver(struct nl_ts_socket *sock, uint32_t seq,
+	struct nl_ts *ts)
+{
+	if(sock->handler.ts)
+		sock->handler.ts(sock->arg, seq, ts);
+}
+
+/* Batch replies carry several NL_TS_A_TS_NESTED records, or one
+ * NL_TS_A_TS_PACKED array, or one NL_TS_A_TS_DELTA stream.
+ */
+static void nl_ts_parse_reply(struct nl_ts_socket *sock,
+	struct nlmsghdr *nlh)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlh);
+	uint32_t seq = nlh->nlmsg_seq;
+	struct nlattr *attr;
+	struct nl_ts_delta d;
+	const uint8_t *p, *end;
+	struct nl_ts ts;
+	size_t i;
+	int rem;
+	int n;
+
+	if(nlh->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN))
+		return;
+
+	nla_for_each_attr(attr, genlmsg_attrdata(gnlh, 0),
+		genlmsg_attrlen(gnlh, 0), rem) {
+		switch(nla_type(attr)) {
+		case NL_TS_A_DESC:
+			if(gnlh->cmd == NL_TS_C_RESOLVE) {
+				sock->desc = nla_get_u32(attr);
+				break;
+			}
+			if(sock->handler.attr)
+				sock->handler.attr(sock->arg, seq,
+					gnlh->cmd, attr);
+			break;
+		case NL_TS_A_TS_NESTED:
+			/* Skipped, the other records may still be fine */
+			if(nl_ts_parse_ts(attr, &ts) != 0)
+				break;
+			nl_ts_deliver(sock, seq, &ts);
+			break;
+		case NL_TS_A_TS_PACKED:
+			for(i = 0 ; i + sizeof(struct nl_ts_packed) <=
+				(size_t) nla_len(attr) ;
+				i += sizeof(struct nl_ts_packed)) {
+				nl_ts_unpack_ts((char *) nla_data(attr) + i, &ts);
+				nl_ts_deliver(sock, seq, &ts);
+			}
+			break;
+		case NL_TS_A_TS_DELTA:
+			memset(&d, 0, sizeof(d));
+			p = nla_data(attr);
+			end = p + nla_len(attr);
+			while(p < end) {
+				/* Nothing after a malformed record decodes */
+				n = nl_ts_delta_decode(&d, p, end, &ts);
+				if(n < 0)
+					break;
+				p += n;
+				nl_ts_deliver(sock, seq, &ts);
+			}
+			break;
+		default:
+			if(sock->handler.attr)
+				sock->handler.attr(sock->arg, seq,
+					gnlh->cmd, attr);
+			break;
+		}
+	}
+}
+
+/* Request seq goes to slot seq % NL_TS_MAX_INFLIGHT, unless a parked
+ * one still holds it
+ */
+static struct nl_ts_inflight *nl_ts_find(struct nl_ts_socket *sock,
+	uint32_t seq)
+{
+	struct nl_ts_inflight *r = &sock->req[seq & (NL_TS_MAX_INFLIGHT - 1)];
+	int i;
+
+	if(r->seq == seq)
+		return r;
+
+	for(i = 0 ; i < NL_TS_MAX_INFLIGHT ; i++) {
+		if(sock->req[i].seq == seq)
+			return &sock->req[i];
+	}
+
+	return NULL;
+}
+
+int nl_ts_slot(struct nl_ts_socket *sock, uint32_t seq)
+{
+	struct nl_ts_inflight *r = nl_ts_find(sock, seq);
+
+	return r ? (int) (r - sock->req) : -1;
+}
+
+/* Returns 1 when seq was a pending request */
+static int nl_ts_complete(struct nl_ts_socket *sock, uint32_t seq, int err)
+{
+	struct nl_ts_inflight *r = nl_ts_find(sock, seq);
+
+	if(!r || !r->busy)
+		return 0;
+
+	r->busy = 0;
+	r->err = err;
+	sock->busy &= ~(1ULL << (r - sock->req));
+	sock->inflight--;
+
+	if(sock->handler.done)
+		sock->handler.done(sock->arg, seq, err);
+
+	return 1;
+}
+
+static int nl_ts_fail_all(struct nl_ts_socket *sock, int err)
+{
+	int done = 0;
+	int i;
+
+	for(i = 0 ; i < NL_TS_MAX_INFLIGHT ; i++) {
+		if(sock->req[i].busy)
+			done += nl_ts_complete(sock, sock->req[i].seq, err);
+	}
+
+	return done;
+}
+
+static int nl_ts_dispatch(struct nl_ts_socket *sock, struct nlmsghdr *nlh)
+{
+	struct nl_ts_inflight *r;
+	struct nlmsgerr *e;
+	uint32_t seq;
+
+	/* Every request ends with its ack, or NLMSG_DONE for a dump, or its
+	 * reply when sent without NLM_F_ACK. Errors are always acked.
+	 */
+	if(nlh->nlmsg_type == NLMSG_ERROR) {
+		if(nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*e)))
+			return 0;
+		e = nlmsg_data(nlh);
+		return nl_ts_complete(sock, nlh->nlmsg_seq, e->error);
+	}
+
+	if(nlh->nlmsg_type == NLMSG_DONE)
+		return nl_ts_complete(sock, nlh->nlmsg_seq, 0);
+
+	/* Pushed timestamps have no request, their seq is 0 */
+	if(nlh->nlmsg_type == sock->family_id) {
+		seq = nlh->nlmsg_seq;
+		if(!seq) {
+			nl_ts_parse_reply(sock, nlh);
+			return 0;
+		}
+
+		/* Late reply of a request an overrun already failed */
+		r = nl_ts_find(sock, seq);
+		if(!r || !r->busy)
+			return 0;
+
+		nl_ts_parse_reply(sock, nlh);
+		if(r->noack && r->cmd ==
+			((struct genlmsghdr *) nlmsg_data(nlh))->cmd)
+			return nl_ts_complete(sock, seq, 0);
+	}
+
+	return 0;
+}
+
+struct nl_ts_socket *nl_ts_socket_init(const char *ifname)
+{
+	struct nl_ts_socket *sock = NULL;
+	int err;
+
+	err = ENOMEM;
+	sock = calloc(1, sizeof(*sock));
+	if(!sock)
+		goto out3;
+
+	strncpy(sock->ifname,ifname,IFNAME_SIZE - 1);
+	sock->desc = -1;
+	sock->encoding = NL_TS_ENC_DEFAULT;
+	sock->version = VERSION_NR;
+
+	sock->msg = nlmsg_alloc_size(NL_TS_TXBUF_SIZE);
+	if(!sock->msg)
+		goto out2;
+
+	sock->nlsock = nl_socket_alloc();
+	if(!sock->nlsock)
+		goto out2;
+
+	/* libnl leaves errno to the failed socket call */
+	if(genl_connect(sock->nlsock) < 0) {
+		err = errno;
+		goto out1;
+	}
+
+	/* The module is not loaded */
+	sock->family_id = genl_ctrl_resolve(sock->nlsock,"NL_TS_FAMILY");
+	if(sock->family_id < 0) {
+		err = ENOENT;
+		goto out1;
+	}
+
+	/* Overruns only come sooner with the default size */
+	nl_socket_set_buffer_size(sock->nlsock, NL_TS_RCVBUF_SIZE, 0);
+
+	sock->fd = nl_socket_get_fd(sock->nlsock);
+
+	return sock;
+
+out1:
+	nl_socket_free(sock->nlsock);
+out2:
+	if(sock->msg)
+		nlmsg_free(sock->msg);
+	free(sock);
+out3:
+	errno = err;
+	return NULL;
+}
+
+void nl_ts_socket_free(struct nl_ts_socket *sock)
+{
+	if(!sock)
+		return;
+
+	nl_socket_free(sock->nlsock);
+	nlmsg_free(sock->msg);
+	free(sock);
+}
+
+void nl_ts_socket_set_handler(struct nl_ts_socket *sock,
+	const struct nl_ts_handler *handler, void *arg)
+{
+	sock->handler = *handler;
+	sock->arg = arg;
+}
+
+void nl_ts_socket_set_format(struct nl_ts_socket *sock, int version,
+	int encoding)
+{
+	sock->version = version;
+	sock->encoding = encoding;
+}
+
+void nl_ts_socket_set_nonblock(struct nl_ts_socket *sock, int nonblock)
+{
+	sock->nonblock = nonblock;
+}
+
+int nl_ts_socket_fd(struct nl_ts_socket *sock)
+{
+	return sock->fd;
+}
+
+unsigned int nl_ts_inflight(struct nl_ts_socket *sock)
+{
+	return sock->inflight;
+}
+
+static int nl_ts_put_req(struct nl_ts_socket *sock, struct nl_msg *msg,
+	int nl_cmd, int tx_rx, const struct nl_ts_req *req)
+{
+	struct nlattr *nested;
+
+	nested = nla_nest_start(msg,NL_TS_A_TS_NESTED);
+	if(!nested)
+		return -EMSGSIZE;
+
+	if(nla_put_u32(msg,NL_TS_A_CMD_NESTED_CMD,tx_rx) < 0)
+		goto out;
+
+	/* Once resolved, the descriptor saves the kernel a name lookup */
+	if(req->flags & NL_TS_REQ_IFNAME) {
+		if(req->ifname && nla_put_string(msg,NL_TS_A_CMD_NESTED_IFACE,
+			req->ifname) < 0)
+			goto out;
+	} else if(req->flags & NL_TS_REQ_DESC) {
+		if(nla_put_u32(msg,NL_TS_A_CMD_NESTED_DESC,req->desc) < 0)
+			goto out;
+	} else if(sock->desc >= 0 && nl_cmd != NL_TS_C_RESOLVE) {
+		if(nla_put_u32(msg,NL_TS_A_CMD_NESTED_DESC,sock->desc) < 0)
+			goto out;
+	} else if(nla_put_string(msg,NL_TS_A_CMD_NESTED_IFACE,
+		sock->ifname) < 0) {
+		goto out;
+	}
+
+	if((req->flags & NL_TS_REQ_MAX_COUNT) && nla_put_u32(msg,
+		NL_TS_A_CMD_NESTED_MAX_COUNT,req->max_count) < 0)
+		goto out;
+
+	if((req->flags & NL_TS_REQ_LIMITS) && (nla_put_u32(msg,
+		NL_TS_A_CMD_NESTED_CAPACITY,req->capacity) < 0 ||
+		nla_put_u32(msg,NL_TS_A_CMD_NESTED_POLICY,req->policy) < 0))
+		goto out;
+
+	if((req->flags & NL_TS_REQ_KEY) && (nla_put_u16(msg,
+		NL_TS_A_CMD_NESTED_ID,req->id) < 0 ||
+		nla_put_u64(msg,NL_TS_A_CMD_NESTED_SEQ,req->seq) < 0))
+		goto out;
+
+	if((req->flags & NL_TS_REQ_COALESCE) && (nla_put_u32(msg,
+		NL_TS_A_CMD_NESTED_FRAMES,req->frames) < 0 ||
+		nla_put_u32(msg,NL_TS_A_CMD_NESTED_USECS,req->usecs) < 0))
+		goto out;
+
+	if((req->flags & NL_TS_REQ_FILTER) && (nla_put_u32(msg,
+		NL_TS_A_CMD_NESTED_TYPES,req->types) < 0 ||
+		nla_put_u16(msg,NL_TS_A_CMD_NESTED_ID_MIN,req->id_min) < 0 ||
+		nla_put_u16(msg,NL_TS_A_CMD_NESTED_ID_MAX,req->id_max) < 0 ||
+		nla_put_u32(msg,NL_TS_A_CMD_NESTED_VALID,req->valid_only) < 0))
+		goto out;
+
+	if((req->flags & NL_TS_REQ_TIMEOUT) && nla_put_u32(msg,
+		NL_TS_A_CMD_NESTED_TIMEOUT,req->timeout) < 0)
+		goto out;
+
+	if(req->flags & NL_TS_REQ_ENCODING) {
+		if(nla_put_u32(msg,NL_TS_A_CMD_NESTED_ENCODING,
+			req->encoding) < 0)
+			goto out;
+	} else if(nl_cmd == NL_TS_C_GETTS_BATCH &&
+		sock->encoding != NL_TS_ENC_DEFAULT) {
+		if(nla_put_u32(msg,NL_TS_A_CMD_NESTED_ENCODING,
+			sock->encoding) < 0)
+			goto out;
+	}
+
+	nla_nest_end(msg,nested);
+	return 0;
+
+out:
+	nla_nest_cancel(msg,nested);
+	return -EMSGSIZE;
+}
+
+int64_t nl_ts_submit(struct nl_ts_socket *sock, int nl_cmd, int tx_rx,
+	const struct nl_ts_req *req)
+{
+	static const struct nl_ts_req none;
+	struct nl_ts_inflight *r;
+	struct nlmsghdr *nlh;
+	uint32_t seq;
+	int flags = NLM_F_REQUEST | NLM_F_ACK;
+	int slot;
+	int err;
+
+	if(!sock)
+		return -EINVAL;
+
+	if(!req)
+		req = &none;
+
+	/* The window is full */
+	while(sock->inflight >= NL_TS_MAX_INFLIGHT) {
+		if(sock->nonblock)
+			return -EAGAIN;
+		if((err = nl_ts_flush(sock)) < 0 ||
+			(err = nl_ts_process(sock, 1)) < 0)
+			return err;
+	}
+
+	/* Any free slot will do when a parked request holds its own */
+	seq = nl_socket_use_seq(sock->nlsock);
+	slot = seq & (NL_TS_MAX_INFLIGHT - 1);
+	if(sock->busy & (1ULL << slot))
+		slot = __builtin_ctzll(~sock->busy);
+	r = &sock->req[slot];
+
+	/* Rewind the scratch message instead of allocating a new one */
+	nlh = nlmsg_hdr(sock->msg);
+	nlh->nlmsg_len = NLMSG_HDRLEN;
+
+	if(req->flags & NL_TS_REQ_DUMP)
+		flags |= NLM_F_DUMP;
+
+	/* A parked request would hold its ack back behind the ones of the
+	 * requests sent after it
+	 */
+	if(req->flags & NL_TS_REQ_TIMEOUT)
+		flags &= ~NLM_F_ACK;
+
+	if(!genlmsg_put(sock->msg,NL_AUTO_PORT,seq,sock->family_id,0,flags,
+		nl_cmd,sock->version))
+		return -EMSGSIZE;
+
+	if(!(req->flags & NL_TS_REQ_DUMP) &&
+		(err = nl_ts_put_req(sock, sock->msg, nl_cmd, tx_rx, req)) < 0)
+		return err;
+
+	/* Attributes keep the length aligned */
+	if(sock->txlen + nlh->nlmsg_len > NL_TS_TXBUF_SIZE &&
+		(err = nl_ts_flush(sock)) < 0)
+		return err;
+
+	memcpy(sock->txbuf + sock->txlen, nlh, nlh->nlmsg_len);
+	sock->txlen += nlh->nlmsg_len;
+
+	r->seq = seq;
+	r->cmd = nl_cmd;
+	r->busy = 1;
+	r->noack = !(flags & NLM_F_ACK);
+	r->err = 0;
+	sock->busy |= 1ULL << slot;
+	sock->inflight++;
+
+	return seq;
+}
+
+/* The kernel handles every message of the buffer in order */
+int nl_ts_flush(struct nl_ts_socket *sock)
+{
+	struct nlmsghdr *nlh;
+	ssize_t n;
+	int len;
+	int err;
+
+	if(!sock->txlen)
+		return 0;
+
+	do {
+		n = send(sock->fd, sock->txbuf, sock->txlen, 0);
+	} while(n < 0 && errno == EINTR);
+
+	if(n < 0) {
+		err = -errno;
+
+		/* None of the queued requests made it */
+		len = sock->txlen;
+		for(nlh = (struct nlmsghdr *) sock->txbuf ; NLMSG_OK(nlh, len) ;
+			nlh = NLMSG_NEXT(nlh, len))
+			nl_ts_complete(sock, nlh->nlmsg_seq, err);
+
+		sock->txlen = 0;
+		return err;
+	}
+
+	sock->txlen = 0;
+	return 0;
+}
+
+int nl_ts_process(struct nl_ts_socket *sock, int block)
+{
+	struct nlmsghdr *nlh;
+	int flags = block ? 0 : MSG_DONTWAIT;
+	int done = 0;
+	ssize_t n;
+	int len;
+
+	for(;;) {
+		n = recv(sock->fd, sock->rxbuf, NL_TS_RXBUF_SIZE,
+			flags | MSG_TRUNC);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == ENOBUFS) {
+				/* Replies were lost, do not wait for them */
+				done += nl_ts_fail_all(sock, -ENOBUFS);
+				if(sock->handler.overrun)
+					sock->handler.overrun(sock->arg);
+				flags = MSG_DONTWAIT;
+				continue;
+			}
+			return -errno;
+		}
+
+		if(n > NL_TS_RXBUF_SIZE)
+			return -EMSGSIZE;
+
+		len = n;
+		for(nlh = (struct nlmsghdr *) sock->rxbuf ; NLMSG_OK(nlh, len) ;
+			nlh = NLMSG_NEXT(nlh, len))
+			done += nl_ts_dispatch(sock, nlh);
+
+		/* Then whatever else is already there */
+		flags = MSG_DONTWAIT;
+	}
+
+	return done;
+}
+
+int nl_ts_wait(struct nl_ts_socket *sock, uint32_t seq)
+{
+	struct nl_ts_inflight *r = nl_ts_find(sock, seq);
+	int err;
+
+	if(!r)
+		return 0;
+
+	if((err = nl_ts_flush(sock)) < 0)
+		return err;
+
+	while(r->busy && r->seq == seq) {
+		if((err = nl_ts_process(sock, 1)) < 0)
+			return err;
+	}
+
+	/* Overwritten by a later request, its error is gone */
+	if(r->seq != seq)
+		return 0;
+
+	return r->err;
+}
+
+int nl_ts_drain(struct nl_ts_socket *sock)
+{
+	int err;
+
+	if((err = nl_ts_flush(sock)) < 0)
+		return err;
+
+	while(sock->inflight > 0) {
+		if((err = nl_ts_process(sock, 1)) < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int nl_ts_request(struct nl_ts_socket *sock, int nl_cmd,
+	int tx_rx, const struct nl_ts_req *req)
+{
+	int64_t seq;
+
+	seq = nl_ts_submit(sock, nl_cmd, tx_rx, req);
+	if(seq < 0)
+		return (int) seq;
+
+	return nl_ts_wait(sock, (uint32_t) seq);
+}
+
+int nl_ts_socket_resolve(struct nl_ts_socket *sock)
+{
+	int err;
+
+	err = nl_ts_request(sock, NL_TS_C_RESOLVE, 0, NULL);
+	if(err < 0)
+		return err;
+
+	return (sock->desc < 0) ? -ENODEV : sock->desc;
+}
+
+int nl_socket_ts_ask(struct nl_ts_socket *sock, int tx_rx)
+{
+	return nl_ts_request(sock, NL_TS_C_GETTS, tx_rx, NULL);
+}
+
+int nl_socket_ts_ask_batch(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int max_count)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	if(max_count) {
+		req.flags = NL_TS_REQ_MAX_COUNT;
+		req.max_count = max_count;
+	}
+
+	return nl_ts_request(sock, NL_TS_C_GETTS_BATCH, tx_rx, &req);
+}
+
+int nl_socket_ts_wait_batch(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int max_count, unsigned int timeout_ms)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_TIMEOUT;
+	req.timeout = timeout_ms;
+	if(max_count) {
+		req.flags |= NL_TS_REQ_MAX_COUNT;
+		req.max_count = max_count;
+	}
+
+	return nl_ts_request(sock, NL_TS_C_GETTS_BATCH, tx_rx, &req);
+}
+
+int nl_socket_ts_ask_id(struct nl_ts_socket *sock, int tx_rx,
+	uint16_t id, uint64_t seq)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_KEY;
+	req.id = id;
+	req.seq = seq;
+
+	return nl_ts_request(sock, NL_TS_C_GETTS_ID, tx_rx, &req);
+}
+
+int nl_ts_socket_reset_hist(struct nl_ts_socket *sock, int tx_rx)
+{
+	return nl_ts_request(sock, NL_TS_C_RESET_HIST, tx_rx, NULL);
+}
+
+int nl_ts_socket_set_queue(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int capacity, int policy)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_LIMITS;
+	req.capacity = capacity;
+	req.policy = policy;
+
+	return nl_ts_request(sock, NL_TS_C_SET_QUEUE, tx_rx, &req);
+}
+
+int nl_ts_socket_set_coalesce(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int frames, unsigned int usecs)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_COALESCE;
+	req.frames = frames;
+	req.usecs = usecs;
+
+	return nl_ts_request(sock, NL_TS_C_SET_COALESCE, tx_rx, &req);
+}
+
+int nl_ts_socket_filter(struct nl_ts_socket *sock, const char *ifname,
+	unsigned int types, uint16_t id_min, uint16_t id_max, int valid_only)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_FILTER | NL_TS_REQ_IFNAME;
+	req.ifname = ifname;
+	req.types = types;
+	req.id_min = id_min;
+	req.id_max = id_max;
+	req.valid_only = valid_only;
+
+	return nl_ts_request(sock, NL_TS_C_SUBSCRIBE, 0, &req);
+}
+
+int nl_ts_socket_unfilter(struct nl_ts_socket *sock)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_IFNAME;
+
+	return nl_ts_request(sock, NL_TS_C_UNSUBSCRIBE, 0, &req);
+}
+
+int nl_ts_socket_stats(struct nl_ts_socket *sock, int nl_cmd)
+{
+	struct nl_ts_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_DUMP;
+
+	return nl_ts_request(sock, nl_cmd, 0, &req);
+}
+
+int nl_ts_socket_subscribe(struct nl_ts_socket *sock, int tx_rx)
+{
+	int err;
+
+	if(!sock)
+		return -EINVAL;
+
+	/* libnl reads the group replies itself, nothing else may be
+	 * pending then. Both groups are resolved before joining any, so
+	 * that no pushed timestamp gets in the way either.
+	 */
+	if(sock->grp[0] <= 0) {
+		if((err = nl_ts_drain(sock)) < 0)
+			return err;
+
+		sock->grp[MYNL_CMD_GETTS_TX] = genl_ctrl_resolve_grp(
+			sock->nlsock, "NL_TS_FAMILY", NL_TS_MCGRP_TX_NAME);
+		sock->grp[MYNL_CMD_GETTS_RX] = genl_ctrl_resolve_grp(
+			sock->nlsock, "NL_TS_FAMILY", NL_TS_MCGRP_RX_NAME);
+		if(sock->grp[0] < 0 || sock->grp[1] < 0) {
+			sock->grp[0] = sock->grp[1] = 0;
+			return -ENOENT;
+		}
+	}
+
+	/* libnl leaves errno to the failed setsockopt() */
+	if(nl_socket_add_membership(sock->nlsock,
+		sock->grp[(tx_rx == MYNL_CMD_GETTS_TX) ?
+		MYNL_CMD_GETTS_TX : MYNL_CMD_GETTS_RX]) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int nl_ts_socket_listen(struct nl_ts_socket *sock)
+{
+	int err;
+
+	if(!sock)
+		return -EINVAL;
+
+	if((err = nl_ts_process(sock, 1)) < 0)
+		return err;
+
+	return 0;
+}
+
+/* A slot is only used once tail was moved past it, the kernel may have
+ * evicted it meanwhile. Only an empty ring costs a poll() call.
+ */
+int nl_ts_mmap_consume(const char *ifname, int tx_rx, int ntimes,
+	const struct nl_ts_handler *handler, void *arg)
+{
+	struct nl_ts_attach attach;
+	struct nl_ts_ring_hdr *hdr;
+	struct nl_ts_queue_element *ring;
+	struct pollfd pfd;
+	size_t size;
+	long page = sysconf(_SC_PAGESIZE);
+	uint32_t head, tail, mask;
+	struct nl_ts ts;
+	int fd;
+	int err;
+	int i = 0;
+
+	fd = open("/dev/" NL_TS_DEV_NAME, O_RDWR);
+	if(fd < 0)
+		return -errno;
+
+	memset(&attach, 0, sizeof(attach));
+	strncpy(attach.iface, ifname, IFNAME_SIZE - 1);
+	attach.type = tx_rx;
+
+	if(ioctl(fd, NL_TS_IOC_ATTACH, &attach) < 0) {
+		err = -errno;
+		goto out2;
+	}
+
+	/* Map the header first to learn the size of the ring */
+	hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+	if(hdr == MAP_FAILED) {
+		err = -errno;
+		goto out2;
+	}
+
+	if(hdr->magic != NL_TS_RING_MAGIC ||
+		hdr->version != NL_TS_RING_VERSION ||
+		hdr->slot_size != sizeof(struct nl_ts_queue_element)) {
+		err = -EPROTO;
+		munmap(hdr, page);
+		goto out2;
+	}
+
+	size = hdr->data_offset +
+		(((size_t) hdr->size * hdr->slot_size + page - 1) & ~(page - 1));
+	munmap(hdr, page);
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(hdr == MAP_FAILED) {
+		err = -errno;
+		goto out2;
+	}
+
+	ring = (struct nl_ts_queue_element *)
+		((char *) hdr + hdr->data_offset);
+	mask = hdr->size - 1;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while(i < ntimes) {
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if(head == tail) {
+			if(poll(&pfd, 1, -1) < 0 || (pfd.revents & POLLHUP))
+				break;
+			continue;
+		}
+
+		ts = ring[tail & mask].ts;
+		if(!__atomic_compare_exchange_n(&hdr->tail, &tail, tail + 1,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+
+		if(handler->ts)
+			handler->ts(arg, 0, &ts);
+		i++;
+	}
+
+	munmap(hdr, size);
+	close(fd);
+	return 0;
+
+out2:
+	close(fd);
+	return err;
+}
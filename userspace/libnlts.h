@@ -0,0 +1,166 @@
+#ifndef __LIBNLTS_H__
+#define __LIBNLTS_H__
+
+#include <stdint.h>
+
+#include <netlink/attr.h>
+
+#include "nl_ts_queue.h"
+
+/* Client of NL_TS_FAMILY. Requests are queued in a preallocated buffer
+ * and sent together by nl_ts_flush(), up to NL_TS_MAX_INFLIGHT of them
+ * wait for their reply at a time. Replies are matched to the request
+ * by netlink sequence number and delivered through struct nl_ts_handler
+ * from nl_ts_process(). A socket is not thread safe. Nothing is printed,
+ * errors are returned as negative errnos.
+ *
+ * An overrun of the receive buffer (ENOBUFS) may have dropped any reply
+ * or pushed timestamp, so it completes every pending request with
+ * -ENOBUFS and then calls the overrun handler. Whatever still arrives
+ * for those requests is ignored: the timestamps a batch had dequeued are
+ * lost.
+ */
+
+#define NL_TS_MAX_INFLIGHT 64	/* power of 2, at most 64 */
+#define NL_TS_TXBUF_SIZE 8192
+#define NL_TS_RXBUF_SIZE 65536
+
+/* Optional arguments of a request, only the flagged ones are sent */
+#define NL_TS_REQ_MAX_COUNT 0x1
+#define NL_TS_REQ_LIMITS 0x2
+#define NL_TS_REQ_KEY 0x4
+#define NL_TS_REQ_ENCODING 0x8
+#define NL_TS_REQ_DESC 0x10	/* another interface than the socket's */
+/* A batch finding its queue empty waits up to timeout ms for a timestamp.
+ * Such a request gets no ack, it completes with its reply.
+ */
+#define NL_TS_REQ_TIMEOUT 0x20
+#define NL_TS_REQ_COALESCE 0x40
+#define NL_TS_REQ_FILTER 0x80
+#define NL_TS_REQ_IFNAME 0x200	/* ifname instead, NULL for none */
+
+struct nl_ts_req {
+	int flags;
+	unsigned int max_count;
+	unsigned int capacity;
+	int policy;
+	uint16_t id;
+	uint64_t seq;
+	int encoding;
+	int desc;
+	unsigned int timeout;
+	unsigned int frames;
+	unsigned int usecs;
+	const char *ifname;
+	unsigned int types;
+	uint16_t id_min;
+	uint16_t id_max;
+	int valid_only;
+};
+
+/* seq is the request a reply belongs to, 0 for pushed timestamps */
+struct nl_ts_handler {
+	/* One timestamp, or a MYNL_CMD_QEMPTY_RESP/MYNL_CMD_QERROR_RESP
+	 * status record ending a reply.
+	 */
+	void (*ts)(void *arg, uint32_t seq, const struct nl_ts *ts);
+	/* Any other attribute of a reply to cmd: NL_TS_A_IFACE, _DESC,
+	 * _MORE, _DROPPED, _STATS or _HIST.
+	 */
+	void (*attr)(void *arg, uint32_t seq, int cmd,
+		const struct nlattr *na);
+	/* Request seq got its last reply, err is 0 or a negative errno */
+	void (*done)(void *arg, uint32_t seq, int err);
+	/* The receive buffer overran, messages were lost */
+	void (*overrun)(void *arg);
+};
+
+struct nl_ts_socket;
+
+/* NULL with errno set on failure, ENOENT without the module */
+struct nl_ts_socket *nl_ts_socket_init(const char *ifname);
+void nl_ts_socket_free(struct nl_ts_socket *sock);
+
+void nl_ts_socket_set_handler(struct nl_ts_socket *sock,
+	const struct nl_ts_handler *handler, void *arg);
+/* version selects the timestamp format of replies, see VERSION_NR,
+ * encoding the NL_TS_ENC_* of batch replies.
+ */
+void nl_ts_socket_set_format(struct nl_ts_socket *sock, int version,
+	int encoding);
+/* nl_ts_submit() returns -EAGAIN instead of waiting for a free slot */
+void nl_ts_socket_set_nonblock(struct nl_ts_socket *sock, int nonblock);
+/* For poll()/epoll, readable once nl_ts_process() has replies to read */
+int nl_ts_socket_fd(struct nl_ts_socket *sock);
+unsigned int nl_ts_inflight(struct nl_ts_socket *sock);
+/* Slot of request seq, from 0 to NL_TS_MAX_INFLIGHT - 1, from its
+ * submission until its done handler returned, -1 for none. Requests do
+ * not complete in order, key per request state with it rather than seq.
+ */
+int nl_ts_slot(struct nl_ts_socket *sock, uint32_t seq);
+
+/* Queue a request without waiting for it. Returns its sequence number,
+ * or a negative errno. With NL_TS_MAX_INFLIGHT requests pending, waits
+ * for any of them first.
+ */
+int64_t nl_ts_submit(struct nl_ts_socket *sock, int nl_cmd, int tx_rx,
+	const struct nl_ts_req *req);
+/* Send the queued requests */
+int nl_ts_flush(struct nl_ts_socket *sock);
+/* Read the replies available, blocking for the first one if block.
+ * Returns how many requests completed, or a negative errno.
+ */
+int nl_ts_process(struct nl_ts_socket *sock, int block);
+/* Flush and process until request seq completed, returns its error */
+int nl_ts_wait(struct nl_ts_socket *sock, uint32_t seq);
+/* Flush and process until no request is pending */
+int nl_ts_drain(struct nl_ts_socket *sock);
+
+/* Synchronous requests, return 0 or a negative errno */
+int nl_ts_socket_resolve(struct nl_ts_socket *sock);
+int nl_socket_ts_ask(struct nl_ts_socket *sock, int tx_rx);
+int nl_socket_ts_ask_batch(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int max_count);
+/* Like nl_socket_ts_ask_batch(), but an empty queue is waited on for up
+ * to timeout_ms (at most NL_TS_MAX_TIMEOUT_MS) before the
+ * MYNL_CMD_QEMPTY_RESP reply.
+ */
+int nl_socket_ts_wait_batch(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int max_count, unsigned int timeout_ms);
+/* Take the timestamp of one frame wherever it sits in the queue */
+int nl_socket_ts_ask_id(struct nl_ts_socket *sock, int tx_rx,
+	uint16_t id, uint64_t seq);
+int nl_ts_socket_reset_hist(struct nl_ts_socket *sock, int tx_rx);
+int nl_ts_socket_set_queue(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int capacity, int policy);
+/* Push the timestamps of one queue once frames of them are pending, or
+ * usecs after the first one
+ */
+int nl_ts_socket_set_coalesce(struct nl_ts_socket *sock, int tx_rx,
+	unsigned int frames, unsigned int usecs);
+/* Dump NL_TS_C_GET_STATS or NL_TS_C_GET_HIST of every interface */
+int nl_ts_socket_stats(struct nl_ts_socket *sock, int nl_cmd);
+
+/* Pushed timestamps, delivered by nl_ts_process() */
+int nl_ts_socket_subscribe(struct nl_ts_socket *sock, int tx_rx);
+int nl_ts_socket_listen(struct nl_ts_socket *sock);
+
+/* Have the kernel send this socket alone the timestamps of ifname (of
+ * every interface with NULL) of types (a mask of 1 << MYNL_CMD_*_OK_RESP,
+ * 0 for both), with an id from id_min to id_max, and only the valid ones
+ * with valid_only. Once per interface of a set, needs CAP_NET_ADMIN.
+ * Delivered by nl_ts_process(), like group ones.
+ */
+int nl_ts_socket_filter(struct nl_ts_socket *sock, const char *ifname,
+	unsigned int types, uint16_t id_min, uint16_t id_max, int valid_only);
+/* Drop the filters of the socket */
+int nl_ts_socket_unfilter(struct nl_ts_socket *sock);
+
+/* Consume ntimes timestamps from the mapped ring of one queue,
+ * delivered through handler->ts. Returns 0 or a negative errno, EPROTO
+ * for a ring layout this library does not know.
+ */
+int nl_ts_mmap_consume(const char *ifname, int tx_rx, int ntimes,
+	const struct nl_ts_handler *handler, void *arg);
+
+#endif /* __LIBNLTS_H__ */
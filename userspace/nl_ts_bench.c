@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <netlink/attr.h>
+
+#include "libnlts.h"
+
+/* Sweeps queue capacities, request modes, batch sizes, pipeline depths
+ * and thread counts against the module and prints one CSV line or JSON
+ * object per point. Every thread has its own socket and keeps pipeline
+ * requests in flight on the queues of one interface, alternating tx and
+ * rx, for the duration of the point. Latency is submit to ack of every
+ * request, CPU time is the one of the whole process, kernel side
+ * included since the requests are handled in the sender's context.
+ * With -c, both queues are bounded to each capacity in turn before its
+ * points (NL_TS_C_SET_QUEUE, needs CAP_NET_ADMIN), and set back to
+ * NL_TS_QUEUE_SIZE and drop-newest at the end; capacity 0 in the
+ * output means the queues were left as they were. The queues are only
+ * occupied when a producer such as mod_netlink feeds the interface,
+ * their depth is then at most the capacity.
+ */
+
+#define NL_TS_B_MAX_THREADS 64
+#define NL_TS_B_MAX_LIST 16
+#define NL_TS_B_MAX_SAMPLES (1 << 20)	/* per thread and point */
+
+enum {
+	NL_TS_B_GETTS,	/* one timestamp per request */
+	NL_TS_B_BATCH,	/* packed batch replies */
+	NL_TS_B_NESTED,	/* nested batch replies, as version 1 */
+	NL_TS_B_DELTA,	/* delta encoded batch replies */
+	NL_TS_B_MODES,
+};
+
+static const char *mode_names[NL_TS_B_MODES] = {
+	"getts", "batch", "nested", "delta",
+};
+
+struct nl_ts_b_list {
+	unsigned int v[NL_TS_B_MAX_LIST];
+	int n;
+};
+
+struct nl_ts_b_point {
+	unsigned int capacity;
+	int mode;
+	unsigned int batch;
+	unsigned int pipeline;
+	unsigned int threads;
+};
+
+struct nl_ts_b_thread {
+	pthread_t tid;
+	struct nl_ts_socket *sock;
+	const struct nl_ts_b_point *pt;
+	uint64_t submitted[NL_TS_MAX_INFLIGHT];	/* ns, by slot */
+	uint64_t *samples;
+	unsigned int n_samples;
+	uint64_t requests;
+	uint64_t timestamps;
+	uint64_t errors;
+	int failed;	/* errno that stopped the thread */
+};
+
+static const char *ifname = "iface0";
+static double duration = 2.0;
+static int json;
+
+static struct nl_ts_b_thread threads[NL_TS_B_MAX_THREADS];
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t) ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+		1000000000ULL +
+		((uint64_t) ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+static void bench_ts(void *arg, uint32_t seq, const struct nl_ts *ts)
+{
+	struct nl_ts_b_thread *t = arg;
+
+	if(ts->type != MYNL_CMD_QEMPTY_RESP &&
+		ts->type != MYNL_CMD_QERROR_RESP)
+		t->timestamps++;
+}
+
+static void bench_done(void *arg, uint32_t seq, int err)
+{
+	struct nl_ts_b_thread *t = arg;
+	uint64_t start = t->submitted[nl_ts_slot(t->sock, seq)];
+
+	if(err < 0)
+		t->errors++;
+
+	if(t->n_samples < NL_TS_B_MAX_SAMPLES)
+		t->samples[t->n_samples++] = now_ns() - start;
+}
+
+static const struct nl_ts_handler bench_handler = {
+	.ts = bench_ts,
+	.done = bench_done,
+};
+
+static void *bench_run(void *arg)
+{
+	struct nl_ts_b_thread *t = arg;
+	const struct nl_ts_b_point *pt = t->pt;
+	struct nl_ts_req req;
+	uint64_t deadline;
+	int64_t seq;
+	int nl_cmd;
+	int tx_rx = 0;
+	int err;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_MAX_COUNT;
+	req.max_count = pt->batch;
+	nl_cmd = (pt->mode == NL_TS_B_GETTS) ? NL_TS_C_GETTS :
+		NL_TS_C_GETTS_BATCH;
+
+	pthread_barrier_wait(&start_barrier);
+	deadline = now_ns() + (uint64_t) (duration * 1e9);
+
+	while(now_ns() < deadline) {
+		seq = nl_ts_submit(t->sock, nl_cmd, tx_rx,
+			(nl_cmd == NL_TS_C_GETTS) ? NULL : &req);
+		if(seq < 0) {
+			t->failed = (int) seq;
+			break;
+		}
+		t->submitted[nl_ts_slot(t->sock, (uint32_t) seq)] = now_ns();
+		t->requests++;
+		tx_rx = !tx_rx;
+
+		while(nl_ts_inflight(t->sock) >= pt->pipeline) {
+			if((err = nl_ts_flush(t->sock)) < 0 ||
+				(err = nl_ts_process(t->sock, 1)) < 0) {
+				t->failed = err;
+				goto out;
+			}
+		}
+	}
+
+out:
+	if((err = nl_ts_drain(t->sock)) < 0)
+		t->failed = err;
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double quantile_us(const uint64_t *v, size_t n, double q)
+{
+	size_t i;
+
+	if(n == 0)
+		return 0;
+
+	i = (size_t) (q * n);
+	if(i >= n)
+		i = n - 1;
+
+	return v[i] / 1000.0;
+}
+
+static void report_header(void)
+{
+	if(json)
+		printf("[\n");
+	else
+		printf("capacity,mode,batch,pipeline,threads,requests,"
+			"timestamps,errors,"
+			"seconds,req_per_s,ts_per_s,lat_p50_us,lat_p90_us,"
+			"lat_p99_us,lat_p999_us,lat_max_us,cpu_ns_per_req,"
+			"cpu_ns_per_ts\n");
+}
+
+static void report_footer(void)
+{
+	if(json)
+		printf("\n]\n");
+}
+
+static int bench_point(const struct nl_ts_b_point *pt, int first)
+{
+	uint64_t requests = 0, timestamps = 0, errors = 0;
+	uint64_t start, elapsed, cpu;
+	uint64_t *all;
+	size_t n = 0;
+	double secs;
+	unsigned int i;
+	int rc = 0;
+
+	for(i = 0 ; i < pt->threads ; i++) {
+		struct nl_ts_b_thread *t = &threads[i];
+
+		t->pt = pt;
+		t->n_samples = 0;
+		t->requests = t->timestamps = t->errors = 0;
+		t->failed = 0;
+		nl_ts_socket_set_format(t->sock,
+			(pt->mode == NL_TS_B_NESTED) ?
+			NL_TS_VERSION_PACKED - 1 : VERSION_NR,
+			(pt->mode == NL_TS_B_DELTA) ?
+			NL_TS_ENC_DELTA : NL_TS_ENC_DEFAULT);
+	}
+
+	if(pthread_barrier_init(&start_barrier, NULL, pt->threads + 1) != 0)
+		return -1;
+
+	for(i = 0 ; i < pt->threads ; i++) {
+		if(pthread_create(&threads[i].tid, NULL, bench_run,
+			&threads[i]) != 0) {
+			fprintf(stderr, "ERROR: Unable to start thread %u \n", i);
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	cpu = cpu_ns();
+
+	for(i = 0 ; i < pt->threads ; i++)
+		pthread_join(threads[i].tid, NULL);
+
+	elapsed = now_ns() - start;
+	cpu = cpu_ns() - cpu;
+	pthread_barrier_destroy(&start_barrier);
+
+	for(i = 0 ; i < pt->threads ; i++) {
+		requests += threads[i].requests;
+		timestamps += threads[i].timestamps;
+		errors += threads[i].errors;
+		n += threads[i].n_samples;
+		if(threads[i].failed) {
+			fprintf(stderr, "ERROR %d: Thread %d stopped \n",
+				threads[i].failed, i);
+			rc = -1;
+		}
+	}
+
+	all = malloc((n ? n : 1) * sizeof(*all));
+	if(!all)
+		return -1;
+
+	n = 0;
+	for(i = 0 ; i < pt->threads ; i++) {
+		memcpy(all + n, threads[i].samples,
+			threads[i].n_samples * sizeof(*all));
+		n += threads[i].n_samples;
+	}
+	qsort(all, n, sizeof(*all), cmp_u64);
+
+	secs = elapsed / 1e9;
+
+	if(json)
+		printf("%s  {\"capacity\": %u, \"mode\": \"%s\", "
+			"\"batch\": %u, \"pipeline\": %u, "
+			"\"threads\": %u, \"requests\": %llu, "
+			"\"timestamps\": %llu, \"errors\": %llu, "
+			"\"seconds\": %.3f, \"req_per_s\": %.0f, "
+			"\"ts_per_s\": %.0f, \"lat_p50_us\": %.2f, "
+			"\"lat_p90_us\": %.2f, \"lat_p99_us\": %.2f, "
+			"\"lat_p999_us\": %.2f, \"lat_max_us\": %.2f, "
+			"\"cpu_ns_per_req\": %.0f, \"cpu_ns_per_ts\": %.0f}",
+			first ? "" : ",\n", pt->capacity,
+			mode_names[pt->mode], pt->batch, pt->pipeline, pt->threads,
+			(unsigned long long) requests,
+			(unsigned long long) timestamps,
+			(unsigned long long) errors, secs,
+			requests / secs, timestamps / secs,
+			quantile_us(all, n, 0.5), quantile_us(all, n, 0.9),
+			quantile_us(all, n, 0.99), quantile_us(all, n, 0.999),
+			n ? all[n - 1] / 1000.0 : 0.0,
+			requests ? (double) cpu / requests : 0.0,
+			timestamps ? (double) cpu / timestamps : 0.0);
+	else
+		printf("%u,%s,%u,%u,%u,%llu,%llu,%llu,%.3f,%.0f,%.0f,%.2f,%.2f,"
+			"%.2f,%.2f,%.2f,%.0f,%.0f\n", pt->capacity,
+			mode_names[pt->mode], pt->batch, pt->pipeline, pt->threads,
+			(unsigned long long) requests,
+			(unsigned long long) timestamps,
+			(unsigned long long) errors, secs,
+			requests / secs, timestamps / secs,
+			quantile_us(all, n, 0.5), quantile_us(all, n, 0.9),
+			quantile_us(all, n, 0.99), quantile_us(all, n, 0.999),
+			n ? all[n - 1] / 1000.0 : 0.0,
+			requests ? (double) cpu / requests : 0.0,
+			timestamps ? (double) cpu / timestamps : 0.0);
+	fflush(stdout);
+
+	free(all);
+	return rc;
+}
+
+static int set_capacity(struct nl_ts_socket *sock, unsigned int capacity)
+{
+	if(nl_ts_socket_set_queue(sock, MYNL_CMD_GETTS_TX, capacity,
+		NL_TS_POLICY_DROP_NEWEST) < 0 ||
+		nl_ts_socket_set_queue(sock, MYNL_CMD_GETTS_RX, capacity,
+		NL_TS_POLICY_DROP_NEWEST) < 0) {
+		fprintf(stderr, "ERROR: Unable to set the capacity to %u \n",
+			capacity);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* "1,8,64" */
+static int parse_list(const char *s, struct nl_ts_b_list *l,
+	unsigned int max)
+{
+	char *end;
+
+	l->n = 0;
+	while(*s && l->n < NL_TS_B_MAX_LIST) {
+		l->v[l->n] = strtoul(s, &end, 10);
+		if(end == s || l->v[l->n] < 1 || l->v[l->n] > max)
+			return -1;
+		l->n++;
+		s = (*end == ',') ? end + 1 : end;
+		if(*end && *end != ',')
+			return -1;
+	}
+
+	return l->n ? 0 : -1;
+}
+
+static int parse_modes(const char *s, int *modes)
+{
+	char buf[64];
+	char *tok, *save;
+	int i;
+
+	memset(modes, 0, NL_TS_B_MODES * sizeof(*modes));
+	strncpy(buf, s, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for(tok = strtok_r(buf, ",", &save) ; tok ;
+		tok = strtok_r(NULL, ",", &save)) {
+		for(i = 0 ; i < NL_TS_B_MODES ; i++) {
+			if(!strcmp(tok, mode_names[i]))
+				break;
+		}
+		if(i == NL_TS_B_MODES)
+			return -1;
+		modes[i] = 1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-c capacities] [-m modes] [-b batches] "
+		"[-q pipelines] [-t threads] [-d seconds] [-I iface] [-j] \n",
+		prog);
+	printf("  -c capacities: queue capacities to bound both queues to, "
+		"left as they are by default \n");
+	printf("  -m modes: of getts,batch,nested,delta, all by default \n");
+	printf("  -b batches: max timestamps per batch request, 1,16,64,256 "
+		"by default \n");
+	printf("  -q pipelines: pipeline depths, requests in flight per "
+		"thread, 1,8,32 by default \n");
+	printf("  -t threads: consumer threads, 1,2,4 by default \n");
+	printf("  -d seconds: duration of every point, 2 by default \n");
+	printf("  -I iface: interface to query, iface0 by default \n");
+	printf("  -j: JSON instead of CSV \n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct nl_ts_b_list batches = { { 1, 16, 64, 256 }, 4 };
+	struct nl_ts_b_list capacities = { { 0 }, 1 };
+	struct nl_ts_b_list pipelines = { { 1, 8, 32 }, 3 };
+	struct nl_ts_b_list nthreads = { { 1, 2, 4 }, 3 };
+	int modes[NL_TS_B_MODES] = { 1, 1, 1, 1 };
+	struct nl_ts_b_point pt;
+	unsigned int max_threads = 0;
+	int first = 1;
+	int rc = 0;
+	int ci, bi, di, ti;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:m:b:q:t:d:I:jh")) != -1) {
+		switch (opt) {
+		case 'c':
+			if(parse_list(optarg, &capacities, NL_TS_QUEUE_SIZE) < 0)
+				goto usage;
+			break;
+		case 'm':
+			if(parse_modes(optarg, modes) < 0)
+				goto usage;
+			break;
+		case 'b':
+			if(parse_list(optarg, &batches, 65535) < 0)
+				goto usage;
+			break;
+		case 'q':
+			if(parse_list(optarg, &pipelines, NL_TS_MAX_INFLIGHT) < 0)
+				goto usage;
+			break;
+		case 't':
+			if(parse_list(optarg, &nthreads, NL_TS_B_MAX_THREADS) < 0)
+				goto usage;
+			break;
+		case 'd':
+			duration = strtod(optarg, NULL);
+			if(duration <= 0)
+				goto usage;
+			break;
+		case 'I':
+			ifname = optarg;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	for(ti = 0 ; ti < nthreads.n ; ti++) {
+		if(nthreads.v[ti] > max_threads)
+			max_threads = nthreads.v[ti];
+	}
+
+	for(i = 0 ; i < max_threads ; i++) {
+		threads[i].sock = nl_ts_socket_init(ifname);
+		if(!threads[i].sock) {
+			perror("ERROR: Unable to open a netlink socket ");
+			return 1;
+		}
+		nl_ts_socket_set_handler(threads[i].sock, &bench_handler,
+			&threads[i]);
+		if(nl_ts_socket_resolve(threads[i].sock) < 0) {
+			fprintf(stderr, "ERROR: Unable to resolve %s \n", ifname);
+			return 1;
+		}
+
+		threads[i].samples = malloc(NL_TS_B_MAX_SAMPLES *
+			sizeof(*threads[i].samples));
+		if(!threads[i].samples) {
+			fprintf(stderr, "ERROR: Unable to reserve memory \n");
+			return 1;
+		}
+	}
+
+	report_header();
+
+	for(ci = 0 ; ci < capacities.n ; ci++) {
+		pt.capacity = capacities.v[ci];
+		if(pt.capacity && set_capacity(threads[0].sock,
+			pt.capacity) < 0) {
+			rc = 1;
+			break;
+		}
+
+		for(pt.mode = 0 ; pt.mode < NL_TS_B_MODES ; pt.mode++) {
+			if(!modes[pt.mode])
+				continue;
+
+			/* Batch sizes mean nothing to single requests */
+			for(bi = 0 ; bi < ((pt.mode == NL_TS_B_GETTS) ? 1 :
+				batches.n) ; bi++) {
+				pt.batch = (pt.mode == NL_TS_B_GETTS) ? 1 :
+					batches.v[bi];
+				for(di = 0 ; di < pipelines.n ; di++) {
+					pt.pipeline = pipelines.v[di];
+					for(ti = 0 ; ti < nthreads.n ; ti++) {
+						pt.threads = nthreads.v[ti];
+						if(bench_point(&pt, first) < 0)
+							rc = 1;
+						first = 0;
+					}
+				}
+			}
+		}
+	}
+
+	if(capacities.v[0] && set_capacity(threads[0].sock,
+		NL_TS_QUEUE_SIZE) < 0)
+		rc = 1;
+
+	report_footer();
+
+	for(i = 0 ; i < max_threads ; i++) {
+		nl_ts_socket_free(threads[i].sock);
+		free(threads[i].samples);
+	}
+
+	return rc;
+
+usage:
+	usage(argv[0]);
+	return 0;
+}
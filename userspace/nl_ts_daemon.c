@@ -0,0 +1,656 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <netlink/attr.h>
+
+#include "libnlts.h"
+
+/* Drains the queues of many interfaces from a few threads. Each thread
+ * owns a share of the interfaces and one socket for their batch
+ * requests, pipelined up to NL_TS_MAX_INFLIGHT, plus optionally one
+ * with a filter for the pushed timestamps of those interfaces (or in the
+ * multicast groups, without the rights). A pushed timestamp only wakes
+ * its queue up, the queue itself is read with NL_TS_C_GETTS_BATCH
+ * until the reply says nothing is left (no NL_TS_A_MORE). A timer
+ * wakes every queue up as well, in case a push was lost or nobody
+ * pushes. Nothing blocks but epoll_wait().
+ */
+
+#define NL_TS_D_MAX_THREADS 16
+#define NL_TS_D_HASH_SIZE 512	/* power of 2 */
+
+struct nl_ts_d_iface;
+
+struct nl_ts_d_queue {
+	struct nl_ts_d_iface *iface;
+	int type;
+	int busy;	/* a batch request is in flight */
+	int again;	/* read it again once that one completes */
+	int ready;	/* on the ready list */
+	struct nl_ts_d_queue *next;
+	uint64_t count;
+};
+
+struct nl_ts_d_iface {
+	char name[IFNAME_SIZE];
+	int desc;
+	int thread;
+	int dead;
+	struct nl_ts_d_queue q[2];
+	struct nl_ts_d_iface *hnext;
+};
+
+struct nl_ts_d_thread {
+	int idx;
+	pthread_t tid;
+	struct nl_ts_socket *sock;
+	struct nl_ts_socket *events;
+	int epfd;
+	int timerfd;
+	struct nl_ts_d_iface *ev_iface;	/* of the event being parsed */
+	struct nl_ts_d_queue *ready_head;
+	struct nl_ts_d_queue *ready_tail;
+	struct nl_ts_d_queue *inflight[NL_TS_MAX_INFLIGHT];
+};
+
+/* Allocated one by one, queues and hash chains point to them */
+static struct nl_ts_d_iface **ifaces;
+static int n_ifaces;
+static int max_ifaces;
+static struct nl_ts_d_iface *hash[NL_TS_D_HASH_SIZE];
+
+static struct nl_ts_d_thread threads[NL_TS_D_MAX_THREADS];
+static int n_threads = 1;
+
+static unsigned int batch = 64;
+static unsigned int interval_ms = 100;
+static int push;
+static int quiet;
+static int encoding = NL_TS_ENC_DEFAULT;
+static int stopfd = -1;
+
+static unsigned int nl_ts_d_hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	while(*name)
+		h = h * 33 + (unsigned char) *name++;
+
+	return h & (NL_TS_D_HASH_SIZE - 1);
+}
+
+static struct nl_ts_d_iface *nl_ts_d_lookup(const char *name)
+{
+	struct nl_ts_d_iface *iface;
+
+	for(iface = hash[nl_ts_d_hash(name)] ; iface ; iface = iface->hnext) {
+		if(!strcmp(iface->name, name))
+			return iface;
+	}
+
+	return NULL;
+}
+
+static struct nl_ts_d_iface *nl_ts_d_add(const char *name)
+{
+	struct nl_ts_d_iface *iface;
+	struct nl_ts_d_iface **tmp;
+	unsigned int h;
+	int i, n;
+
+	iface = nl_ts_d_lookup(name);
+	if(iface)
+		return iface;
+
+	if(n_ifaces == max_ifaces) {
+		n = max_ifaces ? 2 * max_ifaces : 64;
+		tmp = realloc(ifaces, n * sizeof(*ifaces));
+		if(!tmp)
+			return NULL;
+		ifaces = tmp;
+		max_ifaces = n;
+	}
+
+	iface = calloc(1, sizeof(*iface));
+	if(!iface)
+		return NULL;
+	ifaces[n_ifaces++] = iface;
+	strncpy(iface->name, name, IFNAME_SIZE - 1);
+	iface->desc = -1;
+	for(i = 0 ; i < 2 ; i++) {
+		iface->q[i].iface = iface;
+		iface->q[i].type = i;
+	}
+
+	h = nl_ts_d_hash(name);
+	iface->hnext = hash[h];
+	hash[h] = iface;
+
+	return iface;
+}
+
+static void nl_ts_d_wake(struct nl_ts_d_thread *t, struct nl_ts_d_queue *q)
+{
+	if(q->iface->dead)
+		return;
+
+	if(q->busy) {
+		q->again = 1;
+		return;
+	}
+
+	if(q->ready)
+		return;
+
+	q->ready = 1;
+	q->next = NULL;
+	if(t->ready_tail)
+		t->ready_tail->next = q;
+	else
+		t->ready_head = q;
+	t->ready_tail = q;
+}
+
+static struct nl_ts_d_queue *nl_ts_d_pop(struct nl_ts_d_thread *t)
+{
+	struct nl_ts_d_queue *q = t->ready_head;
+
+	if(!q)
+		return NULL;
+
+	t->ready_head = q->next;
+	if(!t->ready_head)
+		t->ready_tail = NULL;
+	q->ready = 0;
+
+	return q;
+}
+
+static void nl_ts_d_wake_all(struct nl_ts_d_thread *t)
+{
+	int i;
+
+	for(i = t->idx ; i < n_ifaces ; i += n_threads) {
+		nl_ts_d_wake(t, &ifaces[i]->q[MYNL_CMD_GETTS_TX]);
+		nl_ts_d_wake(t, &ifaces[i]->q[MYNL_CMD_GETTS_RX]);
+	}
+}
+
+/* Timestamps of the batch replies */
+
+static struct nl_ts_d_queue *nl_ts_d_req(struct nl_ts_d_thread *t,
+	uint32_t seq)
+{
+	int slot = nl_ts_slot(t->sock, seq);
+
+	return (slot < 0) ? NULL : t->inflight[slot];
+}
+
+static void nl_ts_d_ts(void *arg, uint32_t seq, const struct nl_ts *ts)
+{
+	struct nl_ts_d_thread *t = arg;
+	struct nl_ts_d_queue *q = nl_ts_d_req(t, seq);
+
+	if(!q || ts->type == MYNL_CMD_QEMPTY_RESP)
+		return;
+
+	/* The descriptor is gone, unregistered meanwhile */
+	if(ts->type == MYNL_CMD_QERROR_RESP) {
+		if(!q->iface->dead)
+			printf("ERROR: %s went away \n", q->iface->name);
+		q->iface->dead = 1;
+		return;
+	}
+
+	q->count++;
+	if(quiet)
+		return;
+
+	printf("%s %s %lu.%09lu seq %lu id %u%s \n", q->iface->name,
+		q->type ? "rx" : "tx", (unsigned long) ts->sec,
+		(unsigned long) ts->nsec, (unsigned long) ts->seq, ts->id,
+		ts->valid ? "" : " invalid");
+}
+
+static void nl_ts_d_attr(void *arg, uint32_t seq, int cmd,
+	const struct nlattr *na)
+{
+	struct nl_ts_d_thread *t = arg;
+	struct nl_ts_d_queue *q = nl_ts_d_req(t, seq);
+	struct nlattr *attr = (struct nlattr *) na;
+
+	if(q && nla_type(attr) == NL_TS_A_MORE && nla_get_u32(attr))
+		q->again = 1;
+}
+
+static void nl_ts_d_done(void *arg, uint32_t seq, int err)
+{
+	struct nl_ts_d_thread *t = arg;
+	int slot = nl_ts_slot(t->sock, seq);
+	struct nl_ts_d_queue *q;
+
+	if(slot < 0 || !(q = t->inflight[slot]))
+		return;
+
+	t->inflight[slot] = NULL;
+	q->busy = 0;
+
+	/* Left to the timer then, not to spin on a refused request */
+	if(err < 0) {
+		printf("ERROR %d: Request for %s refused \n", err,
+			q->iface->name);
+		q->again = 0;
+		return;
+	}
+
+	if(q->again) {
+		q->again = 0;
+		nl_ts_d_wake(t, q);
+	}
+}
+
+/* Lost replies or pushes, read every queue again rather than wait for
+ * the timer
+ */
+static void nl_ts_d_overrun(void *arg)
+{
+	nl_ts_d_wake_all(arg);
+}
+
+static const struct nl_ts_handler nl_ts_d_handler = {
+	.ts = nl_ts_d_ts,
+	.attr = nl_ts_d_attr,
+	.done = nl_ts_d_done,
+	.overrun = nl_ts_d_overrun,
+};
+
+/* Pushed timestamps, NL_TS_A_IFACE comes first */
+
+static void nl_ts_d_ev_ts(void *arg, uint32_t seq, const struct nl_ts *ts)
+{
+	struct nl_ts_d_thread *t = arg;
+	struct nl_ts_d_iface *iface = t->ev_iface;
+
+	t->ev_iface = NULL;
+	if(!iface || iface->thread != t->idx)
+		return;
+
+	nl_ts_d_wake(t, &iface->q[(ts->type == MYNL_CMD_RX_OK_RESP) ?
+		MYNL_CMD_GETTS_RX : MYNL_CMD_GETTS_TX]);
+}
+
+static void nl_ts_d_ev_attr(void *arg, uint32_t seq, int cmd,
+	const struct nlattr *na)
+{
+	struct nl_ts_d_thread *t = arg;
+	struct nlattr *attr = (struct nlattr *) na;
+
+	if(cmd == NL_TS_C_TS_EVENT && nla_type(attr) == NL_TS_A_IFACE)
+		t->ev_iface = nl_ts_d_lookup(nla_get_string(attr));
+}
+
+static const struct nl_ts_handler nl_ts_d_ev_handler = {
+	.ts = nl_ts_d_ev_ts,
+	.attr = nl_ts_d_ev_attr,
+	.overrun = nl_ts_d_overrun,
+};
+
+/* Send what is ready, as far as the window allows, in one go */
+static int nl_ts_d_submit(struct nl_ts_d_thread *t)
+{
+	struct nl_ts_d_queue *q;
+	struct nl_ts_req req;
+	int64_t seq;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_MAX_COUNT | NL_TS_REQ_DESC;
+	req.max_count = batch;
+
+	while(nl_ts_inflight(t->sock) < NL_TS_MAX_INFLIGHT &&
+		(q = nl_ts_d_pop(t))) {
+		if(q->iface->dead)
+			continue;
+
+		req.desc = q->iface->desc;
+		seq = nl_ts_submit(t->sock, NL_TS_C_GETTS_BATCH, q->type, &req);
+		if(seq == -EAGAIN) {
+			/* The window is full */
+			nl_ts_d_wake(t, q);
+			break;
+		}
+		if(seq < 0) {
+			printf("ERROR %d: Unable to queue a request for %s \n",
+				(int) seq, q->iface->name);
+			break;
+		}
+
+		t->inflight[nl_ts_slot(t->sock, (uint32_t) seq)] = q;
+		q->busy = 1;
+	}
+
+	return nl_ts_flush(t->sock);
+}
+
+static int nl_ts_d_epoll_add(int epfd, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int nl_ts_d_thread_init(struct nl_ts_d_thread *t)
+{
+	struct itimerspec its;
+	int err;
+	int i;
+
+	t->sock = nl_ts_socket_init("");
+	if(!t->sock) {
+		perror("ERROR: Unable to open a netlink socket ");
+		return -1;
+	}
+
+	nl_ts_socket_set_handler(t->sock, &nl_ts_d_handler, t);
+	nl_ts_socket_set_format(t->sock, VERSION_NR, encoding);
+	nl_ts_socket_set_nonblock(t->sock, 1);
+
+	if(push) {
+		t->events = nl_ts_socket_init("");
+		if(!t->events) {
+			perror("ERROR: Unable to open a netlink socket ");
+			return -1;
+		}
+
+		nl_ts_socket_set_handler(t->events, &nl_ts_d_ev_handler, t);
+
+		/* Only the pushes of its own interfaces, not every one of
+		 * them parsed by every thread
+		 */
+		err = 0;
+		for(i = t->idx ; i < n_ifaces && err >= 0 ; i += n_threads) {
+			if(!ifaces[i]->dead)
+				err = nl_ts_socket_filter(t->events,
+					ifaces[i]->name, 0, 0, UINT16_MAX, 0);
+		}
+
+		/* Without CAP_NET_ADMIN, or out of filters, the groups it is */
+		if(err < 0) {
+			nl_ts_socket_unfilter(t->events);
+			if((err = nl_ts_socket_subscribe(t->events,
+				MYNL_CMD_GETTS_TX)) < 0 ||
+				(err = nl_ts_socket_subscribe(t->events,
+				MYNL_CMD_GETTS_RX)) < 0) {
+				printf("ERROR %d: Unable to join the multicast "
+					"groups \n", err);
+				return -1;
+			}
+		}
+	}
+
+	t->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if(t->timerfd < 0) {
+		perror("ERROR: Unable to create the timer ");
+		return -1;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(t->timerfd, 0, &its, NULL) < 0) {
+		perror("ERROR: Unable to arm the timer ");
+		return -1;
+	}
+
+	t->epfd = epoll_create1(0);
+	if(t->epfd < 0) {
+		perror("ERROR: Unable to create the epoll instance ");
+		return -1;
+	}
+
+	if(nl_ts_d_epoll_add(t->epfd, nl_ts_socket_fd(t->sock)) < 0 ||
+		nl_ts_d_epoll_add(t->epfd, t->timerfd) < 0 ||
+		nl_ts_d_epoll_add(t->epfd, stopfd) < 0 ||
+		(t->events && nl_ts_d_epoll_add(t->epfd,
+		nl_ts_socket_fd(t->events)) < 0)) {
+		perror("ERROR: Unable to watch the sockets ");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *nl_ts_d_thread_run(void *arg)
+{
+	struct nl_ts_d_thread *t = arg;
+	struct epoll_event evs[4];
+	uint64_t expired;
+	int n, i;
+	int err;
+
+	/* Whatever was queued before we started */
+	nl_ts_d_wake_all(t);
+
+	for(;;) {
+		if((err = nl_ts_d_submit(t)) < 0) {
+			printf("ERROR %d: Unable to send the requests \n", err);
+			break;
+		}
+
+		n = epoll_wait(t->epfd, evs, 4, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("ERROR: epoll_wait ");
+			break;
+		}
+
+		for(i = 0 ; i < n ; i++) {
+			if(evs[i].data.fd == stopfd)
+				return NULL;
+
+			if(evs[i].data.fd == t->timerfd) {
+				if(read(t->timerfd, &expired, sizeof(expired)) > 0)
+					nl_ts_d_wake_all(t);
+				continue;
+			}
+
+			if(evs[i].data.fd == nl_ts_socket_fd(t->sock))
+				err = nl_ts_process(t->sock, 0);
+			else
+				err = nl_ts_process(t->events, 0);
+			if(err < 0) {
+				printf("ERROR %d: Unable to receive the msg \n",
+					err);
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Learn the descriptors, and with no name given every interface, from
+ * one NL_TS_C_GET_STATS dump.
+ */
+static struct nl_ts_d_iface *discover_cur;
+static int discover_all;
+
+static void discover_attr(void *arg, uint32_t seq, int cmd,
+	const struct nlattr *na)
+{
+	struct nlattr *attr = (struct nlattr *) na;
+
+	if(nla_type(attr) == NL_TS_A_IFACE) {
+		discover_cur = discover_all ?
+			nl_ts_d_add(nla_get_string(attr)) :
+			nl_ts_d_lookup(nla_get_string(attr));
+	} else if(nla_type(attr) == NL_TS_A_DESC && discover_cur) {
+		discover_cur->desc = nla_get_u32(attr);
+		discover_cur = NULL;
+	}
+}
+
+static int discover(void)
+{
+	static const struct nl_ts_handler handler = {
+		.attr = discover_attr,
+	};
+	struct nl_ts_socket *sock;
+	int err;
+
+	sock = nl_ts_socket_init("");
+	if(!sock)
+		return -errno;
+
+	nl_ts_socket_set_handler(sock, &handler, NULL);
+	err = nl_ts_socket_stats(sock, NL_TS_C_GET_STATS);
+	nl_ts_socket_free(sock);
+
+	return err;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-t threads] [-b batch] [-w ms] [-p] [-z] [-q] "
+		"[iface ...] \n", prog);
+	printf("  -t threads: share the interfaces among threads, 1 by "
+		"default \n");
+	printf("  -b batch: timestamps per request, 64 by default \n");
+	printf("  -w ms: read every queue that often, 100 by default \n");
+	printf("  -p: also read a queue as soon as it gets a timestamp \n");
+	printf("  -z: ask for delta encoded batches \n");
+	printf("  -q: only print the totals on exit \n");
+	printf("  iface: the interfaces to drain, all registered ones by "
+		"default \n");
+}
+
+int main(int argc, char *argv[])
+{
+	sigset_t set;
+	uint64_t one = 1;
+	int opt;
+	int sig;
+	int err;
+	int i;
+
+	while ((opt = getopt(argc, argv, "t:b:w:pzqh")) != -1) {
+		switch (opt) {
+		case 't':
+			n_threads = strtol(optarg, NULL, 10);
+			if(n_threads < 1 || n_threads > NL_TS_D_MAX_THREADS)
+				n_threads = NL_TS_D_MAX_THREADS;
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			interval_ms = strtoul(optarg, NULL, 10);
+			if(interval_ms < 1)
+				interval_ms = 1;
+			break;
+		case 'p':
+			push = 1;
+			break;
+		case 'z':
+			encoding = NL_TS_ENC_DELTA;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+
+	discover_all = (optind >= argc);
+	for(i = optind ; i < argc ; i++) {
+		if(!nl_ts_d_add(argv[i])) {
+			printf("ERROR: Unable to reserve memory \n");
+			return 1;
+		}
+	}
+
+	if((err = discover()) < 0) {
+		printf("ERROR %d: Unable to list the interfaces \n", err);
+		return 1;
+	}
+
+	if(n_ifaces == 0) {
+		printf("No interface to drain \n");
+		return 0;
+	}
+
+	if(n_threads > n_ifaces)
+		n_threads = n_ifaces;
+
+	for(i = 0 ; i < n_ifaces ; i++) {
+		if(ifaces[i]->desc < 0) {
+			printf("ERROR: %s is not registered \n", ifaces[i]->name);
+			ifaces[i]->dead = 1;
+		}
+		ifaces[i]->thread = i % n_threads;
+	}
+
+	/* Only main takes the signals, it then wakes every thread up */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	stopfd = eventfd(0, EFD_NONBLOCK);
+	if(stopfd < 0) {
+		perror("ERROR: Unable to create the stop event ");
+		return 1;
+	}
+
+	for(i = 0 ; i < n_threads ; i++) {
+		threads[i].idx = i;
+		if(nl_ts_d_thread_init(&threads[i]) < 0)
+			return 1;
+	}
+
+	for(i = 0 ; i < n_threads ; i++) {
+		if(pthread_create(&threads[i].tid, NULL, nl_ts_d_thread_run,
+			&threads[i]) != 0) {
+			printf("ERROR: Unable to start thread %d \n", i);
+			n_threads = i;
+			break;
+		}
+	}
+
+	sigwait(&set, &sig);
+	if(write(stopfd, &one, sizeof(one)) < 0)
+		perror("ERROR: Unable to stop the threads ");
+
+	for(i = 0 ; i < n_threads ; i++)
+		pthread_join(threads[i].tid, NULL);
+
+	for(i = 0 ; i < n_ifaces ; i++) {
+		printf("%s: tx %llu rx %llu \n", ifaces[i]->name,
+			(unsigned long long) ifaces[i]->q[0].count,
+			(unsigned long long) ifaces[i]->q[1].count);
+	}
+
+	for(i = 0 ; i < n_threads ; i++) {
+		nl_ts_socket_free(threads[i].sock);
+		nl_ts_socket_free(threads[i].events);
+	}
+	close(stopfd);
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+/* Defines the struct qb_layout QB_LAYOUT, named QB_LAYOUT_NAME, on top
+ * of the nl_ts_queue.c functions visible where it is included.
+ */
+
+#include "nl_ts_entry.h"
+#include "qbench.h"
+
+static int qb_l_init(void *q, unsigned int capacity)
+{
+	return nl_ts_queue_init(q, capacity);
+}
+
+static int qb_l_set_limits(void *q, unsigned int capacity, int policy)
+{
+	return nl_ts_queue_set_limits(q, capacity, policy);
+}
+
+static void qb_l_kfree(void *q)
+{
+	nl_ts_queue_kfree(q);
+}
+
+static int qb_l_enqueue(void *q, struct nl_ts *ts)
+{
+	return nl_ts_queue_enqueue(q, ts);
+}
+
+static unsigned int qb_l_enqueue_bulk(void *q, struct nl_ts *ts,
+	unsigned int n)
+{
+	return nl_ts_queue_enqueue_bulk(q, ts, n);
+}
+
+static int qb_l_dequeue(void *q, struct nl_ts *ts)
+{
+	return nl_ts_queue_dequeue(q, ts);
+}
+
+static unsigned long long qb_l_dropped(void *q)
+{
+	return nl_ts_queue_dropped(q);
+}
+
+const struct qb_layout QB_LAYOUT = {
+	.name = QB_LAYOUT_NAME,
+	.entry_size = sizeof(struct nl_ts_table_entry),
+	.tx_offset = offsetof(struct nl_ts_table_entry, tx_queue),
+	.rx_offset = offsetof(struct nl_ts_table_entry, rx_queue),
+	.init = qb_l_init,
+	.set_limits = qb_l_set_limits,
+	.kfree = qb_l_kfree,
+	.enqueue = qb_l_enqueue,
+	.enqueue_bulk = qb_l_enqueue_bulk,
+	.dequeue = qb_l_dequeue,
+	.dropped = qb_l_dropped,
+};
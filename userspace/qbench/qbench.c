@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nl_ts_queue.h"
+#include "qbench.h"
+
+#define QB_LAYOUT qb_padded
+#define QB_LAYOUT_NAME "padded"
+#include "layout.h"
+
+/* Runs kernel/nl_ts_queue.c as a normal process on top of the shim and
+ * prints one CSV line per point. The serial point enqueues and dequeues
+ * a stage worth of timestamps at a time from one thread, measuring the
+ * uncontended cost of both, with one bulk call per stage under -b. The
+ * mpsc points run 1..N producer threads against one consumer thread,
+ * each thread being its own CPU: enq_ns is the time a producer spends
+ * per enqueue, deq_ns the consumer time per timestamp dequeued. The
+ * txrx points do the same on the tx and rx queues of one interface at
+ * once, in the module's own struct nl_ts_table_entry, so that lines
+ * shared between the two show up as a cost over the mpsc point with as
+ * many producers per queue. With -u, both concurrent points also run on
+ * the unpadded layout, right after the padded one. rejected counts the enqueues that failed,
+ * evicted the timestamps pushed out of a full NL_TS_POLICY_DROP_OLDEST
+ * queue. The full point offers twice the capacity to a queue nobody
+ * drains, then checks that the policy held: nothing rejected and the
+ * oldest evicted with -o, nothing evicted without. It exits with an
+ * error otherwise.
+ */
+
+#define QB_MAX_THREADS 64
+#define QB_MAX_LIST 16
+#define QB_MAX_BURST 256
+
+struct qb_list {
+	unsigned int v[QB_MAX_LIST];
+	int n;
+};
+
+enum {
+	QB_MPSC,	/* producers and a consumer on tx_queue */
+	QB_TXRX,	/* the same on both queues */
+};
+
+struct qb_producer {
+	pthread_t tid;
+	void *q;
+	int cpu;
+	int idx;	/* among the producers of q */
+	uint64_t ns;
+	uint64_t enqueued;
+	uint64_t rejected;
+};
+
+struct qb_consumer {
+	pthread_t tid;
+	void *q;
+	int cpu;
+	uint64_t ns;
+	uint64_t dequeued;
+	uint64_t empty;
+};
+
+/* A struct nl_ts_table_entry of layout */
+static const struct qb_layout *layout = &qb_padded;
+static void *iface;
+static struct qb_producer producers[QB_MAX_THREADS];
+static struct qb_consumer consumers[2];
+static pthread_barrier_t start_barrier;
+static unsigned int n_producers;
+static int producers_left;
+
+static unsigned long n_ops = 1000000;
+static unsigned int capacity = NL_TS_QUEUE_SIZE;
+static int policy = NL_TS_POLICY_DROP_NEWEST;
+static unsigned int burst = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_ts(struct nl_ts *ts, uint64_t seq)
+{
+	ts->type = MYNL_CMD_TX_OK_RESP;
+	ts->sec = seq / 1000000;
+	ts->nsec = seq % 1000000 * 1000;
+	ts->seq = seq;
+	ts->id = (uint16_t) seq;
+	ts->valid = 1;
+	ts->ahead = 0;
+}
+
+static int parse_list(const char *s, struct qb_list *l)
+{
+	char *end;
+	unsigned long v;
+
+	l->n = 0;
+	while (*s) {
+		if (l->n == QB_MAX_LIST)
+			return -1;
+		v = strtoul(s, &end, 0);
+		if (end == s || v == 0 || v > QB_MAX_THREADS)
+			return -1;
+		l->v[l->n++] = v;
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
+	}
+
+	return l->n > 0 ? 0 : -1;
+}
+
+static void *tx_queue(void)
+{
+	return (char *) iface + layout->tx_offset;
+}
+
+static void *rx_queue(void)
+{
+	return (char *) iface + layout->rx_offset;
+}
+
+static int iface_setup(unsigned int cpus)
+{
+	nr_cpu_ids = cpus;
+
+	if (posix_memalign(&iface, SMP_CACHE_BYTES,
+		layout->entry_size) != 0) {
+		fprintf(stderr, "ERROR: Unable to reserve memory \n");
+		return -1;
+	}
+	memset(iface, 0, layout->entry_size);
+
+	if (layout->init(tx_queue(), capacity) != 0 ||
+		layout->init(rx_queue(), capacity) != 0) {
+		fprintf(stderr, "ERROR: Unable to allocate the queues \n");
+		exit(1);
+	}
+	layout->set_limits(tx_queue(), capacity, policy);
+	layout->set_limits(rx_queue(), capacity, policy);
+
+	return 0;
+}
+
+static void iface_free(void)
+{
+	layout->kfree(tx_queue());
+	layout->kfree(rx_queue());
+	free(iface);
+	iface = NULL;
+}
+
+static void run_serial(void)
+{
+	void *q;
+	struct nl_ts ts[NL_TS_STAGE_SIZE];
+	uint64_t enq_ns = 0, deq_ns = 0, t;
+	uint64_t enqueued = 0, rejected = 0, dequeued = 0;
+	unsigned long i;
+	unsigned int n;
+	int j;
+
+	if (iface_setup(1) != 0)
+		return;
+	q = tx_queue();
+	kshim_set_cpu(0);
+
+	for (i = 0; i < n_ops; i += NL_TS_STAGE_SIZE) {
+		t = now_ns();
+		for (j = 0; j < NL_TS_STAGE_SIZE; j++)
+			fill_ts(&ts[j], i + j);
+		if (burst > 1) {
+			n = layout->enqueue_bulk(q, ts, NL_TS_STAGE_SIZE);
+			enqueued += n;
+			rejected += NL_TS_STAGE_SIZE - n;
+		} else {
+			for (j = 0; j < NL_TS_STAGE_SIZE; j++) {
+				if (layout->enqueue(q, &ts[j]) >= 0)
+					enqueued++;
+				else
+					rejected++;
+			}
+		}
+		enq_ns += now_ns() - t;
+
+		t = now_ns();
+		for (j = 0; j < NL_TS_STAGE_SIZE; j++) {
+			if (layout->dequeue(q, &ts[0]) == 0)
+				dequeued++;
+		}
+		deq_ns += now_ns() - t;
+	}
+
+	printf("serial,%s,1,%llu,%llu,%llu,%llu,%.1f,%.1f,%.2f\n",
+		layout->name,
+		(unsigned long long) enqueued, (unsigned long long) rejected,
+		layout->dropped(q) - rejected,
+		(unsigned long long) dequeued,
+		(double) enq_ns / (enqueued + rejected),
+		dequeued ? (double) deq_ns / dequeued : 0.0,
+		(enqueued + rejected) * 1000.0 / (enq_ns + deq_ns));
+
+	iface_free();
+}
+
+/* Returns -1 when the queue did not follow its policy once full */
+static int run_full(void)
+{
+	void *q;
+	struct nl_ts ts;
+	uint64_t total = 2 * (uint64_t) capacity;
+	uint64_t enqueued = 0, rejected = 0, evicted, dequeued = 0;
+	uint64_t first = 0;
+	uint64_t t, enq_ns, deq_ns;
+	uint64_t i;
+	int rc = 0;
+
+	if (iface_setup(1) != 0)
+		return -1;
+	q = tx_queue();
+	kshim_set_cpu(0);
+
+	t = now_ns();
+	for (i = 0; i < total; i++) {
+		fill_ts(&ts, i);
+		if (layout->enqueue(q, &ts) >= 0)
+			enqueued++;
+		else
+			rejected++;
+	}
+	enq_ns = now_ns() - t;
+
+	t = now_ns();
+	while (layout->dequeue(q, &ts) == 0) {
+		if (dequeued++ == 0)
+			first = ts.seq;
+	}
+	deq_ns = now_ns() - t;
+	evicted = layout->dropped(q) - rejected;
+
+	printf("full,%s,1,%llu,%llu,%llu,%llu,%.1f,%.1f,%.2f\n",
+		layout->name,
+		(unsigned long long) enqueued, (unsigned long long) rejected,
+		(unsigned long long) evicted, (unsigned long long) dequeued,
+		(double) enq_ns / total,
+		dequeued ? (double) deq_ns / dequeued : 0.0,
+		total * 1000.0 / (enq_ns + deq_ns));
+
+	if (dequeued + rejected + evicted != total)
+		rc = -1;
+	else if (policy == NL_TS_POLICY_DROP_OLDEST)
+		rc = (rejected == 0 && evicted > 0 && first == evicted) ? 0 : -1;
+	else
+		rc = (evicted == 0 && rejected > 0 && first == 0) ? 0 : -1;
+	if (rc != 0)
+		fprintf(stderr, "ERROR: Capacity %u not enforced as %s \n",
+			capacity, policy == NL_TS_POLICY_DROP_OLDEST ?
+			"drop-oldest" : "drop-newest");
+
+	iface_free();
+	return rc;
+}
+
+static void *producer_thread(void *arg)
+{
+	struct qb_producer *p = arg;
+	struct nl_ts ts[QB_MAX_BURST];
+	uint64_t t;
+	unsigned long i;
+	unsigned int b, n;
+
+	kshim_set_cpu(p->cpu);
+	pthread_barrier_wait(&start_barrier);
+
+	t = now_ns();
+	for (i = 0; i < n_ops; i += burst) {
+		/* Interleaved seqs, as from producers sharing one device */
+		if (burst == 1) {
+			fill_ts(&ts[0], (uint64_t) i * n_producers + p->idx);
+			if (layout->enqueue(p->q, &ts[0]) >= 0)
+				p->enqueued++;
+			else
+				p->rejected++;
+			continue;
+		}
+
+		for (b = 0; b < burst; b++)
+			fill_ts(&ts[b], (uint64_t) (i + b) * n_producers + p->idx);
+		n = layout->enqueue_bulk(p->q, ts, burst);
+		p->enqueued += n;
+		p->rejected += burst - n;
+	}
+	p->ns = now_ns() - t;
+
+	__atomic_sub_fetch(&producers_left, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *consumer_thread(void *arg)
+{
+	struct qb_consumer *c = arg;
+	struct nl_ts ts;
+	uint64_t t;
+	int done = 0;
+
+	kshim_set_cpu(c->cpu);
+	pthread_barrier_wait(&start_barrier);
+
+	t = now_ns();
+	for (;;) {
+		if (layout->dequeue(c->q, &ts) == 0) {
+			c->dequeued++;
+			continue;
+		}
+		c->empty++;
+
+		/* One more pass once the last producer is gone */
+		if (done)
+			break;
+		done = __atomic_load_n(&producers_left, __ATOMIC_ACQUIRE) == 0;
+	}
+	c->ns = now_ns() - t;
+
+	return NULL;
+}
+
+/* n producers per queue, consumers on CPUs 0 (tx) and 1 (rx) */
+static void run_concurrent(const struct qb_layout *l, int mode,
+	unsigned int n)
+{
+	uint64_t enq_ns = 0, deq_ns = 0;
+	uint64_t enqueued = 0, rejected = 0, evicted = 0, dequeued = 0;
+	unsigned int n_queues = mode == QB_TXRX ? 2 : 1;
+	unsigned int n_threads = n_queues * n;
+	void *queues[2];
+	unsigned int i;
+
+	layout = l;
+	if (iface_setup(n_queues + n_threads) != 0)
+		return;
+	queues[0] = tx_queue();
+	queues[1] = rx_queue();
+
+	n_producers = n;
+	producers_left = n_threads;
+	memset(producers, 0, sizeof(producers));
+	memset(consumers, 0, sizeof(consumers));
+	pthread_barrier_init(&start_barrier, NULL, n_threads + n_queues);
+
+	for (i = 0; i < n_queues; i++) {
+		consumers[i].q = queues[i];
+		consumers[i].cpu = i;
+		if (pthread_create(&consumers[i].tid, NULL, consumer_thread,
+			&consumers[i]) != 0) {
+			fprintf(stderr, "ERROR: Unable to start a consumer \n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < n_threads; i++) {
+		producers[i].q = queues[i % n_queues];
+		producers[i].idx = i / n_queues;
+		producers[i].cpu = n_queues + i;
+		if (pthread_create(&producers[i].tid, NULL, producer_thread,
+			&producers[i]) != 0) {
+			fprintf(stderr, "ERROR: Unable to start thread %u \n", i);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(producers[i].tid, NULL);
+	for (i = 0; i < n_queues; i++)
+		pthread_join(consumers[i].tid, NULL);
+	pthread_barrier_destroy(&start_barrier);
+
+	for (i = 0; i < n_threads; i++) {
+		enq_ns += producers[i].ns;
+		enqueued += producers[i].enqueued;
+		rejected += producers[i].rejected;
+	}
+	for (i = 0; i < n_queues; i++) {
+		deq_ns += consumers[i].ns;
+		dequeued += consumers[i].dequeued;
+		evicted += layout->dropped(queues[i]);
+	}
+	evicted -= rejected;
+
+	/* The consumers run as long as the point, mops is per queue */
+	printf("%s,%s,%u,%llu,%llu,%llu,%llu,%.1f,%.1f,%.2f\n",
+		mode == QB_TXRX ? "txrx" : "mpsc", layout->name, n,
+		(unsigned long long) enqueued, (unsigned long long) rejected,
+		(unsigned long long) evicted, (unsigned long long) dequeued,
+		(double) enq_ns / (enqueued + rejected),
+		dequeued ? (double) deq_ns / dequeued : 0.0,
+		(enqueued + rejected) * 1000.0 / deq_ns);
+
+	iface_free();
+	layout = &qb_padded;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-t producers] [-n ops] [-b burst] [-c capacity] "
+		"[-o] [-x] [-u] [-h] \n", prog);
+	printf("  -t producers: producer thread counts per queue, 1,2,4 by "
+		"default \n");
+	printf("  -n ops: enqueues per producer, 1000000 by default \n");
+	printf("  -b burst: timestamps per nl_ts_queue_enqueue_bulk() call "
+		"of the producers, 1 (nl_ts_queue_enqueue()) by default \n");
+	printf("  -c capacity: queue capacity, up to %d, %d by default \n",
+		NL_TS_QUEUE_MAX_SIZE, NL_TS_QUEUE_SIZE);
+	printf("  -o: drop the oldest timestamps instead of the newest \n");
+	printf("  -x: also run every count on the tx and rx queues at once \n");
+	printf("  -u: also run every count on the layout without cache line "
+		"alignment \n");
+	printf("Prints mode,layout,producers,enqueued,rejected,evicted,dequeued,"
+		"enq_ns,deq_ns,mops \n");
+}
+
+int main(int argc, char **argv)
+{
+	struct qb_list threads = { { 1, 2, 4 }, 3 };
+	int txrx = 0;
+	int unpadded = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "t:n:b:c:oxuh")) != -1) {
+		switch (opt) {
+		case 't':
+			if (parse_list(optarg, &threads) != 0)
+				goto usage;
+			break;
+		case 'n':
+			n_ops = strtoul(optarg, NULL, 0);
+			if (n_ops == 0)
+				goto usage;
+			break;
+		case 'b':
+			burst = strtoul(optarg, NULL, 0);
+			if (burst == 0 || burst > QB_MAX_BURST)
+				goto usage;
+			break;
+		case 'c':
+			capacity = strtoul(optarg, NULL, 0);
+			if (capacity == 0 || capacity > NL_TS_QUEUE_MAX_SIZE)
+				goto usage;
+			break;
+		case 'o':
+			policy = NL_TS_POLICY_DROP_OLDEST;
+			break;
+		case 'x':
+			txrx = 1;
+			break;
+		case 'u':
+			unpadded = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	/* One CPU per producer plus the consumers' */
+	for (i = 0; i < threads.n; i++) {
+		if (2 * threads.v[i] + 2 > QB_MAX_THREADS)
+			goto usage;
+	}
+
+	printf("mode,layout,producers,enqueued,rejected,evicted,dequeued,"
+		"enq_ns,deq_ns,mops\n");
+	run_serial();
+	if (run_full() != 0)
+		return 1;
+	for (i = 0; i < threads.n; i++) {
+		run_concurrent(&qb_padded, QB_MPSC, threads.v[i]);
+		if (unpadded)
+			run_concurrent(&qb_unpadded, QB_MPSC, threads.v[i]);
+		if (!txrx)
+			continue;
+		run_concurrent(&qb_padded, QB_TXRX, threads.v[i]);
+		if (unpadded)
+			run_concurrent(&qb_unpadded, QB_TXRX, threads.v[i]);
+	}
+
+	return 0;
+
+usage:
+	usage(argv[0]);
+	return 1;
+}
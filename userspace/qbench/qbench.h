@@ -0,0 +1,32 @@
+#ifndef __QBENCH_H__
+#define __QBENCH_H__
+
+#include <stddef.h>
+
+struct nl_ts;
+
+/* One build of kernel/nl_ts_queue.c with the table entry of the module
+ * around its queues. Queues are opaque to qbench.c, which runs every
+ * layout through the same calls.
+ */
+struct qb_layout {
+	const char *name;
+	size_t entry_size;
+	size_t tx_offset;	/* of tx_queue in the entry */
+	size_t rx_offset;
+	int (*init)(void *q, unsigned int capacity);
+	int (*set_limits)(void *q, unsigned int capacity, int policy);
+	void (*kfree)(void *q);
+	int (*enqueue)(void *q, struct nl_ts *ts);
+	unsigned int (*enqueue_bulk)(void *q, struct nl_ts *ts,
+		unsigned int n);
+	int (*dequeue)(void *q, struct nl_ts *ts);
+	unsigned long long (*dropped)(void *q);
+};
+
+/* As the module builds it */
+extern const struct qb_layout qb_padded;
+/* Without any ____cacheline_aligned_in_smp, see unpadded.c */
+extern const struct qb_layout qb_unpadded;
+
+#endif /* __QBENCH_H__ */
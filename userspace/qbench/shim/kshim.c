@@ -0,0 +1,27 @@
+#include "kshim.h"
+
+unsigned int nr_cpu_ids = 1;
+__thread int kshim_cpu;
+
+void *kshim_alloc_percpu(size_t size)
+{
+	void *p;
+
+	/* Would overlap the copy of the next CPU */
+	if (size > KSHIM_PERCPU_STRIDE) {
+		printf("ERROR: per-CPU object of %zu bytes, the shim takes %d \n",
+			size, KSHIM_PERCPU_STRIDE);
+		abort();
+	}
+
+	if (posix_memalign(&p, SMP_CACHE_BYTES,
+		(size_t) nr_cpu_ids * KSHIM_PERCPU_STRIDE) != 0)
+		return NULL;
+	memset(p, 0, (size_t) nr_cpu_ids * KSHIM_PERCPU_STRIDE);
+	return p;
+}
+
+void kshim_free_percpu(void *p)
+{
+	free(p);
+}
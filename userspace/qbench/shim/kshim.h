@@ -0,0 +1,429 @@
+#ifndef __KSHIM_H__
+#define __KSHIM_H__
+
+/* Just enough of the kernel API to build the queue code as a normal
+ * process. Every thread is a CPU: it must call kshim_set_cpu() with an
+ * id below nr_cpu_ids, unique among the running threads, before using
+ * a queue. There are no interrupts, so IRQ masking is a no-op and
+ * irq_work runs right away on the calling thread. Built with
+ * QB_UNPADDED, structures lose their cache line alignment, as the
+ * module laid them out before they had any.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;	/* as in the kernel, for printk */
+typedef int32_t s32;
+typedef long long s64;
+
+#define __init
+#define __exit
+#define __percpu
+#define GFP_KERNEL 0
+
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned __attribute__((aligned(SMP_CACHE_BYTES)))
+#ifdef QB_UNPADDED
+#define ____cacheline_aligned_in_smp
+#else
+#define ____cacheline_aligned_in_smp ____cacheline_aligned
+#endif
+
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type) (a), (type) (b))
+#define max_t(type, a, b) max((type) (a), (type) (b))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+
+#define printk printf
+#define KERN_INFO ""
+#define KERN_ERR ""
+
+/* CPUs */
+
+extern unsigned int nr_cpu_ids;
+extern __thread int kshim_cpu;
+
+static inline void kshim_set_cpu(int cpu)
+{
+	kshim_cpu = cpu;
+}
+
+#define smp_processor_id() kshim_cpu
+#define for_each_possible_cpu(cpu) \
+	for ((cpu) = 0; (cpu) < (int) nr_cpu_ids; (cpu)++)
+
+#define local_irq_save(flags) ((flags) = 0)
+#define local_irq_restore(flags) ((void) (flags))
+
+/* Per-CPU data. Like the kernel's, every allocation is laid out with
+ * the same distance between the copies of two CPUs, so that a field
+ * can be reached from the address of its copy on CPU 0.
+ */
+
+#define KSHIM_PERCPU_STRIDE 4096
+
+void *kshim_alloc_percpu(size_t size);
+void kshim_free_percpu(void *p);
+
+#define alloc_percpu(type) \
+	((type *) kshim_alloc_percpu(sizeof(type)))
+#define free_percpu(p) kshim_free_percpu(p)
+
+#define kshim_cpu_ptr(ptr, cpu) \
+	((typeof(ptr)) ((char *) (ptr) + (size_t) (cpu) * KSHIM_PERCPU_STRIDE))
+#define per_cpu_ptr(ptr, cpu) kshim_cpu_ptr(ptr, cpu)
+#define this_cpu_ptr(ptr) kshim_cpu_ptr(ptr, kshim_cpu)
+#define this_cpu_inc(pcp) ((*kshim_cpu_ptr(&(pcp), kshim_cpu))++)
+#define __this_cpu_inc(pcp) this_cpu_inc(pcp)
+#define this_cpu_add(pcp, v) ((*kshim_cpu_ptr(&(pcp), kshim_cpu)) += (v))
+#define __this_cpu_add(pcp, v) this_cpu_add(pcp, v)
+
+/* Memory */
+
+static inline void *kzalloc(size_t size, int flags)
+{
+	return calloc(1, size);
+}
+
+static inline void *kmalloc(size_t size, int flags)
+{
+	return malloc(size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, int flags)
+{
+	return calloc(n, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *) p);
+}
+
+static inline void *vmalloc_user(unsigned long size)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, PAGE_ALIGN(size)) != 0)
+		return NULL;
+	memset(p, 0, PAGE_ALIGN(size));
+	return p;
+}
+
+static inline void vfree(const void *p)
+{
+	free((void *) p);
+}
+
+/* Barriers and atomics */
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define cmpxchg(p, old, new) __sync_val_compare_and_swap((p), (old), (new))
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+typedef struct {
+	long counter;
+} atomic_long_t;
+
+#define ATOMIC_INIT(i) { (i) }
+#define ATOMIC_LONG_INIT(i) { (i) }
+
+#define atomic_read(v) READ_ONCE((v)->counter)
+#define atomic_set(v, i) WRITE_ONCE((v)->counter, (i))
+#define atomic_inc(v) __atomic_fetch_add(&(v)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_dec_and_test(v) \
+	(__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+#define atomic_cmpxchg(v, old, new) cmpxchg(&(v)->counter, (old), (new))
+
+#define atomic_long_read(v) READ_ONCE((v)->counter)
+#define atomic_long_set(v, i) WRITE_ONCE((v)->counter, (i))
+#define atomic_long_add(i, v) \
+	__atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_sub(i, v) \
+	__atomic_fetch_sub(&(v)->counter, (i), __ATOMIC_RELAXED)
+
+/* Locks */
+
+typedef struct {
+	pthread_spinlock_t lock;
+} spinlock_t;
+
+#define spin_lock_init(l) pthread_spin_init(&(l)->lock, PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(l) pthread_spin_lock(&(l)->lock)
+#define spin_unlock(l) pthread_spin_unlock(&(l)->lock)
+#define spin_trylock(l) (pthread_spin_trylock(&(l)->lock) == 0)
+#define spin_lock_irqsave(l, flags) do { \
+		(flags) = 0; \
+		spin_lock(l); \
+	} while (0)
+#define spin_unlock_irqrestore(l, flags) do { \
+		(void) (flags); \
+		spin_unlock(l); \
+	} while (0)
+#define spin_lock_bh(l) spin_lock(l)
+#define spin_unlock_bh(l) spin_unlock(l)
+
+struct kref {
+	atomic_t refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+	atomic_set(&kref->refcount, 1);
+}
+
+static inline void kref_get(struct kref *kref)
+{
+	atomic_inc(&kref->refcount);
+}
+
+static inline int kref_put(struct kref *kref, void (*release)(struct kref *))
+{
+	if (atomic_dec_and_test(&kref->refcount)) {
+		release(kref);
+		return 1;
+	}
+	return 0;
+}
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+	struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new,
+	struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, typeof(*pos), member); \
+		&pos->member != (head); \
+		pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_entry((head)->next, typeof(*pos), member), \
+		n = list_entry(pos->member.next, typeof(*pos), member); \
+		&pos->member != (head); \
+		pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/* Nobody sleeps on a queue here */
+
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) ((void) (wq))
+#define waitqueue_active(wq) 0
+#define wake_up_interruptible(wq) ((void) (wq))
+
+struct irq_work {
+	void (*func)(struct irq_work *);
+};
+
+static inline void init_irq_work(struct irq_work *work,
+	void (*func)(struct irq_work *))
+{
+	work->func = func;
+}
+
+static inline int irq_work_queue(struct irq_work *work)
+{
+	work->func(work);
+	return 1;
+}
+
+#define irq_work_sync(work) ((void) (work))
+
+/* Deferred work, only laid out for the module's table entry, about as
+ * large as in the kernel
+ */
+
+struct tasklet_struct {
+	struct tasklet_struct *next;
+	unsigned long state;
+	atomic_t count;
+	void (*func)(unsigned long);
+	unsigned long data;
+};
+
+struct hrtimer {
+	void *opaque[8];
+};
+
+struct tasklet_hrtimer {
+	struct hrtimer timer;
+	struct tasklet_struct tasklet;
+	void *function;
+};
+
+struct work_struct {
+	atomic_long_t data;
+	struct list_head entry;
+	void (*func)(struct work_struct *);
+};
+
+struct timer_list {
+	void *opaque[6];
+};
+
+struct delayed_work {
+	struct work_struct work;
+	struct timer_list timer;
+	void *wq;
+	int cpu;
+};
+
+/* Time */
+
+#define NSEC_PER_SEC 1000000000ULL
+
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (u64) t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+}
+
+/* Bits */
+
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BIT_WORD(nr) ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr) (1UL << ((nr) % BITS_PER_LONG))
+
+static inline int test_bit(long nr, const volatile unsigned long *addr)
+{
+	return (addr[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+static inline void __set_bit(long nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(long nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	return 1UL << fls64(n - 1);
+}
+
+/* Bob Jenkins' lookup3, as in linux/jhash.h */
+
+#define JHASH_INITVAL 0xdeadbeef
+
+static inline u32 rol32(u32 word, unsigned int shift)
+{
+	return (word << (shift & 31)) | (word >> ((-shift) & 31));
+}
+
+#define __jhash_final(a, b, c) do { \
+		c ^= b; c -= rol32(b, 14); \
+		a ^= c; a -= rol32(c, 11); \
+		b ^= a; b -= rol32(a, 25); \
+		c ^= b; c -= rol32(b, 16); \
+		a ^= c; a -= rol32(c, 4); \
+		b ^= a; b -= rol32(a, 14); \
+		c ^= b; c -= rol32(b, 24); \
+	} while (0)
+
+static inline u32 __jhash_nwords(u32 a, u32 b, u32 c, u32 initval)
+{
+	a += initval;
+	b += initval;
+	c += initval;
+
+	__jhash_final(a, b, c);
+
+	return c;
+}
+
+static inline u32 jhash_2words(u32 a, u32 b, u32 initval)
+{
+	return __jhash_nwords(a, b, 0, initval + JHASH_INITVAL + (2 << 2));
+}
+
+#endif /* __KSHIM_H__ */
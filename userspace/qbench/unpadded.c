@@ -0,0 +1,31 @@
+/* kernel/nl_ts_queue.c and the table entry once more, as laid out
+ * before the tx, rx and collector state got their own cache lines:
+ * QB_UNPADDED empties ____cacheline_aligned_in_smp in the shim. The
+ * functions are renamed so that both builds link into qbench.
+ */
+
+#define QB_UNPADDED
+
+#define nl_ts_queue_mem_usage qb_u_queue_mem_usage
+#define nl_ts_queue_init qb_u_queue_init
+#define nl_ts_queue_enqueue qb_u_queue_enqueue
+#define nl_ts_queue_enqueue_bulk qb_u_queue_enqueue_bulk
+#define nl_ts_queue_is_empty qb_u_queue_is_empty
+#define nl_ts_queue_dequeue_bulk qb_u_queue_dequeue_bulk
+#define nl_ts_queue_dequeue qb_u_queue_dequeue
+#define nl_ts_queue_take qb_u_queue_take
+#define nl_ts_queue_set_limits qb_u_queue_set_limits
+#define nl_ts_queue_dropped qb_u_queue_dropped
+#define nl_ts_queue_get_stats qb_u_queue_get_stats
+#define nl_ts_queue_get_hist qb_u_queue_get_hist
+#define nl_ts_queue_reset_hist qb_u_queue_reset_hist
+#define nl_ts_queue_kfree qb_u_queue_kfree
+#define nl_ts_queue_map_attach qb_u_queue_map_attach
+#define nl_ts_queue_map_detach qb_u_queue_map_detach
+#define nl_ts_queue_printk qb_u_queue_printk
+
+#include "nl_ts_queue.c"
+
+#define QB_LAYOUT qb_unpadded
+#define QB_LAYOUT_NAME "unpadded"
+#include "layout.h"
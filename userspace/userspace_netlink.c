@@ -2,34 +2,16 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
-#include <unistd.h>
-#include <poll.h>
 #include <string.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <signal.h>
-
-#include <linux/netlink.h>
-#include <linux/genetlink.h>
+#include <unistd.h>
 
-#include <netlink/socket.h>
-#include <netlink/genl/genl.h>
-#include <netlink/cli/utils.h>
+#include <netlink/attr.h>
 
-#include "nl_ts_queue.h"
+#include "libnlts.h"
 
 #define NTIMES 100
 
-struct nl_ts_socket {
-	struct nl_sock *nlsock;
-	int family_id;
-	char ifname[IFNAME_SIZE];
-};
-
-void printf_ts(struct nl_ts *ts)
+static void printf_ts(const struct nl_ts *ts)
 {
 	printf("============== TS ================ \n");
 	printf("Type: %s \n", (ts->type == 0) ? "Tx" : "Rx");
@@ -42,201 +24,419 @@ void printf_ts(struct nl_ts *ts)
 	printf("================================== \n");
 }
 
-static struct nla_policy nested_policy[NL_TS_A_TS_NESTED_MAX + 1] = 
+static struct nla_policy stats_policy[NL_TS_A_STATS_MAX + 1] = 
 {
-	[NL_TS_A_TS_NESTED_SEC] = { .type = NLA_U64 },
-	[NL_TS_A_TS_NESTED_NSEC] = { .type = NLA_U64 },
-	[NL_TS_A_TS_NESTED_SEQ] = { .type = NLA_U64 },
-	[NL_TS_A_TS_NESTED_ID] = { .type = NLA_U16 },
-	[NL_TS_A_TS_NESTED_AHEAD] = { .type = NLA_U32 },
-	[NL_TS_A_TS_NESTED_VALID] = { .type = NLA_U32 },
-	[NL_TS_A_TS_NESTED_TYPE] = { .type = NLA_U32 },
+	[NL_TS_A_STATS_TYPE] = { .type = NLA_U32 },
+	[NL_TS_A_STATS_ENQUEUED] = { .type = NLA_U64 },
+	[NL_TS_A_STATS_DEQUEUED] = { .type = NLA_U64 },
+	[NL_TS_A_STATS_DROPPED] = { .type = NLA_U64 },
+	[NL_TS_A_STATS_EMPTY_POLLS] = { .type = NLA_U64 },
+	[NL_TS_A_STATS_DEPTH] = { .type = NLA_U32 },
+	[NL_TS_A_STATS_HIGH_WATERMARK] = { .type = NLA_U32 },
+	[NL_TS_A_STATS_CAPACITY] = { .type = NLA_U32 },
+	[NL_TS_A_STATS_POLICY] = { .type = NLA_U32 },
 };
 
-static int callback(struct nl_msg *msg, void *arg) {
-	struct nlmsghdr *nlh = nlmsg_hdr(msg);
-    struct nlattr *attr[NL_TS_A_MAX+1];
-    struct nlattr *nested[NL_TS_A_TS_NESTED_MAX+1];
-    char *buf;
-    int err;
-    struct nl_ts ts;
-    
-    err = genlmsg_parse(nlh, 0, attr, NL_TS_A_MAX, NULL);
-    if(err != 0)
-		printf("ERROR %d: Unable to parse NL attributes \n", err);
-		
-	nla_parse_nested(nested,NL_TS_A_TS_NESTED_MAX,
-		attr[NL_TS_A_TS_NESTED],nested_policy);
-		
-	ts.sec = nla_get_u64(nested[NL_TS_A_TS_NESTED_SEC]);
-	ts.nsec = nla_get_u64(nested[NL_TS_A_TS_NESTED_NSEC]);
-	ts.seq = nla_get_u64(nested[NL_TS_A_TS_NESTED_SEQ]);
-	ts.valid = nla_get_u32(nested[NL_TS_A_TS_NESTED_VALID]);
-	ts.type = nla_get_u32(nested[NL_TS_A_TS_NESTED_TYPE]);
-	ts.ahead = nla_get_u32(nested[NL_TS_A_TS_NESTED_AHEAD]);
-	ts.id = nla_get_u16(nested[NL_TS_A_TS_NESTED_ID]);
-    
-    if (ts.type != MYNL_CMD_QEMPTY_RESP 
-		&& ts.type != MYNL_CMD_QERROR_RESP) {
-		printf_ts(&ts);
-	} else {
-		if (ts.type == MYNL_CMD_QEMPTY_RESP)
-			printf("QUEUE EMPTY.\n");
-		else
-			printf("QUEUE ERROR.\n");
-	}
-
-    return NL_OK;
-}
-
-struct nl_ts_socket * nl_ts_socket_init(const char *ifname)
+static void printf_stats(struct nlattr *na)
 {
-	struct nl_ts_socket *sock = NULL;
-	int err;
+	struct nlattr *st[NL_TS_A_STATS_MAX+1];
+	int i;
 	
-	sock = malloc(sizeof(*sock));
-	if(!sock)
-		goto out2;
-		
-	strncpy(sock->ifname,ifname,IFNAME_SIZE);
-	
-	sock->nlsock = nl_socket_alloc();
-	if(!sock->nlsock) {
-		perror("ERROR: Unable to create socket \n");
-		goto out2;
-	}
-	
-	if(genl_connect(sock->nlsock) < 0) {
-		perror("ERROR: Unable to connect to Generic Netlink \n");
-		goto out1;
+	if(nla_parse_nested(st,NL_TS_A_STATS_MAX,na,stats_policy) != 0) {
+		printf("ERROR: Unable to parse the queue stats \n");
+		return;
 	}
 	
-	sock->family_id = genl_ctrl_resolve(sock->nlsock,"NL_TS_FAMILY");
-	if(sock->family_id < 0) {
-		perror("ERROR: Unable to get the Family ID \n");
-		goto out1;
+	for(i = NL_TS_A_STATS_TYPE ; i <= NL_TS_A_STATS_MAX ; i++) {
+		if(!st[i]) {
+			printf("ERROR: Incomplete queue stats \n");
+			return;
+		}
 	}
 	
-	nl_socket_disable_seq_check(sock->nlsock);
+	printf("  %s: enq %llu deq %llu drop %llu empty %llu "
+		"depth %u hwm %u cap %u %s \n",
+		nla_get_u32(st[NL_TS_A_STATS_TYPE]) ? "Rx" : "Tx",
+		(unsigned long long) nla_get_u64(st[NL_TS_A_STATS_ENQUEUED]),
+		(unsigned long long) nla_get_u64(st[NL_TS_A_STATS_DEQUEUED]),
+		(unsigned long long) nla_get_u64(st[NL_TS_A_STATS_DROPPED]),
+		(unsigned long long) nla_get_u64(st[NL_TS_A_STATS_EMPTY_POLLS]),
+		nla_get_u32(st[NL_TS_A_STATS_DEPTH]),
+		nla_get_u32(st[NL_TS_A_STATS_HIGH_WATERMARK]),
+		nla_get_u32(st[NL_TS_A_STATS_CAPACITY]),
+		(nla_get_u32(st[NL_TS_A_STATS_POLICY]) == 
+			NL_TS_POLICY_DROP_OLDEST) ? "drop-oldest" : "drop-newest");
+}
+
+/* Upper bound in ns of the bucket holding quantile q of the samples */
+static unsigned long long hist_quantile(uint64_t *buckets, uint64_t total, 
+	double q)
+{
+	uint64_t rank = (uint64_t) (q * total);
+	uint64_t seen = 0;
+	int i;
 	
-	if((err = nl_socket_modify_cb(sock->nlsock, NL_CB_VALID, 
-		NL_CB_CUSTOM, callback, NULL)) <  0 ) {
-		printf("ERROR: Unable to modify valid message callback \n");
-		goto out1;
+	for(i = 0 ; i < NL_TS_HIST_BUCKETS ; i++) {
+		seen += buckets[i];
+		if(seen > rank)
+			break;
 	}
 	
-	return sock;
-
-out1:
-	nl_socket_free(sock->nlsock);
-out2:
-	return NULL;
+	if(i >= NL_TS_HIST_BUCKETS - 1)
+		return ~0ULL;
+	
+	return 1ULL << i;
 }
 
-int nl_socket_ts_ask(struct nl_ts_socket * sock, 
-	int tx_rx)
+static void printf_hist(struct nlattr *na)
 {
-	struct nl_msg *msg;
-	void *p;
-	int err;
-	struct nlattr *nested;
+	struct nlattr *h[NL_TS_A_HIST_MAX+1];
+	struct nlattr *b;
+	uint64_t buckets[NL_TS_HIST_BUCKETS];
+	uint64_t total = 0;
+	int rem;
 	
-	if(!sock)
-		return -1;
-	
-	msg = nlmsg_alloc();
-	if(!msg) {
-		printf("ERROR: Unable to reserve memory \n");
-		goto out2;
-	}
-		
-	p = genlmsg_put(msg,0,0,sock->family_id,0,0,
-		NL_TS_C_GETTS,VERSION_NR);
-	if(!p) {
-		printf("ERROR: Unable to initialize the header packet \n");
-		goto out1;
+	if(nla_parse_nested(h,NL_TS_A_HIST_MAX,na,NULL) != 0 ||
+		!h[NL_TS_A_HIST_TYPE] || !h[NL_TS_A_HIST_BUCKETS]) {
+		printf("ERROR: Unable to parse the latency histogram \n");
+		return;
 	}
 	
-	nested = nla_nest_start(msg,NL_TS_A_TS_NESTED);
-		
-	if((err = nla_put_u32(msg,
-		NL_TS_A_CMD_NESTED_CMD,tx_rx)) < 0) {
-		printf("ERROR %d: Unable to add type nested attribute. \n",
-			err);
-		nla_nest_cancel(msg,nested);
-		goto out1;
-	}
-		
-	if((err = nla_put_string(msg,
-		NL_TS_A_CMD_NESTED_IFACE,"iface0")) < 0) {
-		printf("ERROR %d: Unable to add type nested attribute. \n",
-			err);
-		nla_nest_cancel(msg,nested);
-		goto out1;
+	memset(buckets, 0, sizeof(buckets));
+	nla_for_each_nested(b, h[NL_TS_A_HIST_BUCKETS], rem) {
+		if(nla_type(b) < 1 || nla_type(b) > NL_TS_HIST_BUCKETS)
+			continue;
+		buckets[nla_type(b) - 1] = nla_get_u64(b);
+		total += buckets[nla_type(b) - 1];
 	}
-		
-	nla_nest_end(msg,nested);
 	
-	if((err = nl_send_auto_complete(sock->nlsock,msg)) < 0) {
-		printf("ERROR: Unable to send the msg \n");
-		goto out1;
+	printf("  %s: %llu samples, p50 < %llu ns, p99 < %llu ns, "
+		"p999 < %llu ns \n",
+		nla_get_u32(h[NL_TS_A_HIST_TYPE]) ? "Rx" : "Tx",
+		(unsigned long long) total,
+		hist_quantile(buckets, total, 0.5),
+		hist_quantile(buckets, total, 0.99),
+		hist_quantile(buckets, total, 0.999));
+}
+
+/* Status records are the only timestamps that end a reply */
+static void handle_ts(void *arg, uint32_t seq, const struct nl_ts *ts)
+{
+	if (ts->type != MYNL_CMD_QEMPTY_RESP 
+		&& ts->type != MYNL_CMD_QERROR_RESP) {
+		printf_ts(ts);
+	} else {
+		if (ts->type == MYNL_CMD_QEMPTY_RESP)
+			printf("QUEUE EMPTY.\n");
+		else
+			printf("QUEUE ERROR.\n");
 	}
+}
+
+static void handle_attr(void *arg, uint32_t seq, int cmd, 
+	const struct nlattr *na)
+{
+	struct nlattr *attr = (struct nlattr *) na;
 	
-	if((err = nl_recvmsgs_default(sock->nlsock)) < 0) {
-		printf("ERROR %d: Unable to receive the msg \n",err);
-		goto out1;
+	if (nla_type(attr) == NL_TS_A_IFACE)
+		printf("Iface: %s \n", nla_get_string(attr));
+	else if (nla_type(attr) == NL_TS_A_STATS)
+		printf_stats(attr);
+	else if (nla_type(attr) == NL_TS_A_HIST)
+		printf_hist(attr);
+	else if (nla_type(attr) == NL_TS_A_MORE) {
+		if (nla_get_u32(attr))
+			printf("MORE PENDING.\n");
+	} else if (nla_type(attr) == NL_TS_A_DROPPED) {
+		if (nla_get_u64(attr))
+			printf("DROPPED: %llu \n", (unsigned long long) 
+				nla_get_u64(attr));
 	}
-	
-	nl_wait_for_ack(sock->nlsock);
-	
-	nlmsg_free(msg);
-	return 0;
+}
 
-out1:
-	nlmsg_free(msg);
-out2:
-	return -1;
+static void handle_done(void *arg, uint32_t seq, int err)
+{
+	if (err < 0)
+		printf("ERROR %d: Request %u refused \n", err, seq);
 }
 
-void nl_ts_socket_free(struct nl_ts_socket *sock)
+static void handle_overrun(void *arg)
 {
-	if(!sock)
-		return;
-	
-	nl_socket_free(sock->nlsock);
-	free(sock);
+	printf("ERROR: Receive buffer overrun \n");
+}
+
+static const struct nl_ts_handler handler = {
+	.ts = handle_ts,
+	.attr = handle_attr,
+	.done = handle_done,
+	.overrun = handle_overrun,
+};
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-b batch] [-p] [-m tx|rx] [-c capacity [-o]] [-s] "
+		"[-l] [-r] [-i id:seq] [-n] [-z] [-q depth] [-w ms] "
+		"[-C frames:usecs] [-F id_min:id_max] [-I iface] [ntimes] \n", 
+		prog);
+	printf("  -b batch: drain up to batch timestamps per request \n");
+	printf("  -p: wait for pushed timestamps instead of polling \n");
+	printf("  -m tx|rx: read one queue through its mapped ring \n");
+	printf("  -c capacity: bound both queues to capacity timestamps \n");
+	printf("  -o: evict the oldest timestamps of a full queue \n");
+	printf("  -s: print the queue counters of every interface \n");
+	printf("  -l: print the queue latency histograms of every interface \n");
+	printf("  -r: reset the latency histograms of the interface \n");
+	printf("  -i id:seq: take the tx timestamp of one frame \n");
+	printf("  -n: ask for nested timestamp attributes, as version 1 \n");
+	printf("  -z: ask for delta encoded batches \n");
+	printf("  -q depth: keep up to depth requests in flight \n");
+	printf("  -w ms: wait up to ms for a timestamp when a queue is empty, "
+		"then drain a batch \n");
+	printf("  -C frames:usecs: push timestamps by frames, or usecs after "
+		"the first one \n");
+	printf("  -F id_min:id_max: with -p, only get the valid timestamps of "
+		"the interface with an id in range (0-65535), filtered by the "
+		"kernel \n");
+	printf("  -I iface: interface to query, iface0 by default \n");
 }
 
 int main(int argc, char *argv[]) {
 
 	struct nl_ts_socket *sock;
 	int i, ntimes;
+	int batch = 0;
+	int push = 0;
+	int stats = 0;
+	int reset = 0;
+	int lookup = 0;
+	int nested = 0;
+	int delta = 0;
+	unsigned int depth = 1;
+	unsigned int wait = 0;
+	const char *ifname = "iface0";
+	struct nl_ts_req req;
+	unsigned long id = 0;
+	unsigned long long seq = 0;
+	char *end;
+	int mapped = -1;
+	int capacity = 0;
+	unsigned long frames = 0;
+	unsigned long usecs = 0;
+	int filter = 0;
+	unsigned long id_min = 0;
+	unsigned long id_max = 0;
+	int policy = NL_TS_POLICY_DROP_NEWEST;
+	int opt;
+	int err;
+	int64_t sent;
     uint32_t tx_rx;
 	
-	if (argc < 2) {
+	while ((opt = getopt(argc, argv, "b:pm:c:oslri:nzq:w:C:F:I:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch = strtol(optarg,(char **) NULL, 10);
+			break;
+		case 'p':
+			push = 1;
+			break;
+		case 'm':
+			mapped = strcmp(optarg, "rx") ? MYNL_CMD_GETTS_TX : 
+				MYNL_CMD_GETTS_RX;
+			break;
+		case 'c':
+			capacity = strtol(optarg,(char **) NULL, 10);
+			break;
+		case 'o':
+			policy = NL_TS_POLICY_DROP_OLDEST;
+			break;
+		case 's':
+			stats = NL_TS_C_GET_STATS;
+			break;
+		case 'l':
+			stats = NL_TS_C_GET_HIST;
+			break;
+		case 'r':
+			reset = 1;
+			break;
+		case 'n':
+			nested = 1;
+			break;
+		case 'z':
+			delta = 1;
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 10);
+			if(depth < 1 || depth > NL_TS_MAX_INFLIGHT)
+				depth = NL_TS_MAX_INFLIGHT;
+			break;
+		case 'w':
+			wait = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			frames = strtoul(optarg, &end, 10);
+			if(*end != ':' || frames < 1) {
+				usage(argv[0]);
+				return 0;
+			}
+			usecs = strtoul(end + 1, NULL, 10);
+			break;
+		case 'F':
+			id_min = strtoul(optarg, &end, 10);
+			if(*end != ':' || id_min > UINT16_MAX) {
+				usage(argv[0]);
+				return 0;
+			}
+			id_max = strtoul(end + 1, &end, 10);
+			if(*end || id_max > UINT16_MAX || id_min > id_max) {
+				usage(argv[0]);
+				return 0;
+			}
+			filter = 1;
+			break;
+		case 'I':
+			ifname = optarg;
+			break;
+		case 'i':
+			id = strtoul(optarg, &end, 10);
+			if(*end != ':') {
+				usage(argv[0]);
+				return 0;
+			}
+			seq = strtoull(end + 1, NULL, 10);
+			lookup = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	
+	if (optind >= argc) {
 		printf("Using %d times for the netlink test \n", NTIMES);
 		ntimes = NTIMES;
 	}
 	else {
-		ntimes = strtol(argv[1],(char **) NULL, 10);
+		ntimes = strtol(argv[optind],(char **) NULL, 10);
 	}
 	
-	sock = nl_ts_socket_init("iface0");
-	if(!sock)
+	if (mapped >= 0) {
+		err = nl_ts_mmap_consume(ifname, mapped, ntimes, 
+			&handler, NULL);
+		if (err < 0)
+			printf("ERROR %d: Unable to read the mapped ring \n", err);
+		return err < 0;
+	}
+	
+	sock = nl_ts_socket_init(ifname);
+	if(!sock) {
+		perror("ERROR: Unable to open the netlink socket ");
 		goto out2;
+	}
 	
+	nl_ts_socket_set_handler(sock, &handler, NULL);
+	nl_ts_socket_set_format(sock, 
+		nested ? NL_TS_VERSION_PACKED - 1 : VERSION_NR, 
+		delta ? NL_TS_ENC_DELTA : NL_TS_ENC_DEFAULT);
+	
+	if (stats) {
+		nl_ts_socket_stats(sock, stats);
+		goto out1;
+	}
+	
+	if (lookup) {
+		nl_socket_ts_ask_id(sock, MYNL_CMD_GETTS_TX, id, seq);
+		goto out1;
+	}
+	
+	if (reset) {
+		/* A type that is neither tx nor rx resets both queues */
+		nl_ts_socket_reset_hist(sock, -1);
+		goto out1;
+	}
+	
+	if(nl_ts_socket_resolve(sock) < 0)
+		printf("Unable to resolve %s, using its name \n", ifname);
+	
+	if (capacity > 0) {
+		if(nl_ts_socket_set_queue(sock, MYNL_CMD_GETTS_TX, 
+			capacity, policy) < 0 ||
+			nl_ts_socket_set_queue(sock, MYNL_CMD_GETTS_RX, 
+			capacity, policy) < 0)
+			goto out1;
+	}
+	
+	if (frames > 0) {
+		if(nl_ts_socket_set_coalesce(sock, MYNL_CMD_GETTS_TX, 
+			frames, usecs) < 0 ||
+			nl_ts_socket_set_coalesce(sock, MYNL_CMD_GETTS_RX, 
+			frames, usecs) < 0)
+			goto out1;
+	}
+	
+	if (push) {
+		/* A filter takes the place of the groups */
+		if (filter) {
+			if(nl_ts_socket_filter(sock, ifname, 0, id_min, id_max, 
+				1) < 0)
+				goto out1;
+		} else if((err = nl_ts_socket_subscribe(sock, 
+			MYNL_CMD_GETTS_TX)) < 0 ||
+			(err = nl_ts_socket_subscribe(sock, 
+			MYNL_CMD_GETTS_RX)) < 0) {
+			printf("ERROR %d: Unable to join the multicast groups \n", 
+				err);
+			goto out1;
+		}
+		
+		for(i = 0 ; i < ntimes ; i++) {
+			if((err = nl_ts_socket_listen(sock)) < 0) {
+				printf("ERROR %d: Unable to receive the msg \n", err);
+				goto out1;
+			}
+		}
+		
+		goto out1;
+	}
+	
+	memset(&req, 0, sizeof(req));
+	req.flags = NL_TS_REQ_MAX_COUNT;
+	req.max_count = batch;
+	
+	/* Long-polling is for batches, 0 drains as many as fit */
+	if (wait > 0) {
+		req.flags |= NL_TS_REQ_TIMEOUT;
+		req.timeout = wait;
+	}
+	
+	/* Requests go out depth at a time, replies come back meanwhile */
 	for(i = 0 ; i < ntimes ; i++) {
 		if (i % 2 == 0)
 			tx_rx = 0;
 		else
 			tx_rx = 1;
 			
-		if(nl_socket_ts_ask(sock, tx_rx) < 0)
+		sent = nl_ts_submit(sock, 
+			(batch > 0 || wait > 0) ? NL_TS_C_GETTS_BATCH : 
+			NL_TS_C_GETTS, 
+			tx_rx, (batch > 0 || wait > 0) ? &req : NULL);
+		if(sent < 0) {
+			printf("ERROR %d: Unable to queue the request \n", 
+				(int) sent);
 			goto out1;
-			
-		//sleep(1);
+		}
+		
+		while(nl_ts_inflight(sock) >= depth) {
+			if((err = nl_ts_flush(sock)) < 0 || 
+				(err = nl_ts_process(sock, 1)) < 0) {
+				printf("ERROR %d: Unable to exchange the msgs \n", err);
+				goto out1;
+			}
+		}
 	}
 	
+	if((err = nl_ts_drain(sock)) < 0)
+		printf("ERROR %d: Unable to exchange the msgs \n", err);
+	
 out1:
 	nl_ts_socket_free(sock);
 out2: